@@ -0,0 +1,358 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/thread.hpp>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../histogram.h"
+
+// loopback benchmark of port_forward: a local sink server, the forwarder in front of it, and a
+// load generator; prints one JSON object per forwarder configuration
+
+struct Config{
+    std::string forwarder = "../port_forward";
+    std::vector<std::string> modes{"accept", "socks5", "filter"};
+    int concurrency = 64;
+    std::size_t size = 1024;
+    // round trips per connection before reconnecting, 0 keeps the connection for the whole run
+    int messages = 100;
+    double duration = 10;
+    int threads = 1;
+    int client_threads = 1;
+};
+
+// the request and the response of one round trip, both exactly size bytes
+struct Payload{
+    std::string request;
+    std::string response;
+
+    Payload(std::string const & mode, std::size_t size){
+        if(mode == "filter"){
+            // HTTP messages so the filter has something to parse
+            request = http("GET /bench HTTP/1.1\r\nHost: bench\r\nContent-Length: ", size);
+            response = http("HTTP/1.1 200 OK\r\nContent-Length: ", size);
+        }
+        if(request.size() != size || response.size() != size){
+            request.assign(size, 'q');
+            response.assign(size, 'r');
+        }
+    }
+    static std::string http(std::string const & head, std::size_t size){
+        for(std::size_t body = 0; body < size; ++body){
+            auto message = head + std::to_string(body) + "\r\n\r\n";
+            if(message.size() + body == size)
+                return message + std::string(body, 'b');
+            if(message.size() + body > size)
+                break;
+        }
+        return "";
+    }
+};
+
+// reads one request worth of bytes, answers with the response, until the client goes away
+class Sink{
+    boost::asio::io_service io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::thread_group threads_;
+    std::string response_;
+    std::size_t request_size_;
+
+    void do_accept(){
+        auto socket = std::make_shared<boost::asio::ip::tcp::socket>(io_);
+        acceptor_.async_accept(*socket, [this, socket](boost::system::error_code ec){
+            if(ec)
+                return;
+            boost::asio::spawn(io_, [this, socket](boost::asio::yield_context yield){
+                std::vector<char> buf(request_size_);
+                boost::system::error_code ec;
+                socket->set_option(boost::asio::ip::tcp::no_delay(true), ec);
+                while(true){
+                    boost::asio::async_read(*socket, boost::asio::buffer(buf), yield[ec]);
+                    if(ec)
+                        break;
+                    boost::asio::async_write(*socket, boost::asio::buffer(response_), yield[ec]);
+                    if(ec)
+                        break;
+                }
+            });
+            do_accept();
+        });
+    }
+public:
+    Sink(Payload const & payload, int threads):acceptor_(io_), response_(payload.response), request_size_(payload.request.size()){
+        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen(4096);
+        do_accept();
+        for(auto i = 0; i < threads; ++i){
+            threads_.create_thread([this](){
+                io_.run();
+            });
+        }
+    }
+    ~Sink(){
+        io_.stop();
+        threads_.join_all();
+    }
+    unsigned short port(){
+        return acceptor_.local_endpoint().port();
+    }
+};
+
+unsigned short free_port(){
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0));
+    return acceptor.local_endpoint().port();
+}
+
+// the forwarder under test, in its own process so its cpu time and memory can be read from /proc
+class Forwarder{
+    pid_t pid_ = -1;
+
+    std::string proc(std::string const & file){
+        std::ifstream in("/proc/" + std::to_string(pid_) + "/" + file);
+        std::stringstream out;
+        out << in.rdbuf();
+        return out.str();
+    }
+public:
+    Forwarder(std::string const & path, std::vector<std::string> const & args){
+        pid_ = ::fork();
+        if(pid_ < 0)
+            throw std::runtime_error("fork failed");
+        if(pid_ == 0){
+            // matched downloads and logs are not part of the measurement
+            auto null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, 1);
+            std::vector<char *> argv;
+            argv.push_back(const_cast<char *>(path.c_str()));
+            for(auto const & arg : args){
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            ::execv(path.c_str(), argv.data());
+            std::cerr << "failed to run " << path << "\n";
+            ::_exit(127);
+        }
+    }
+    ~Forwarder(){
+        if(pid_ > 0){
+            ::kill(pid_, SIGTERM);
+            ::waitpid(pid_, nullptr, 0);
+        }
+    }
+    // ready once it accepts
+    void wait_ready(unsigned short port){
+        boost::asio::io_service io;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while(true){
+            boost::asio::ip::tcp::socket socket(io);
+            boost::system::error_code ec;
+            socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port), ec);
+            if(! ec)
+                return;
+            if(std::chrono::steady_clock::now() > deadline)
+                throw std::runtime_error("forwarder did not start");
+            usleep(10000);
+        }
+    }
+    // user + system time
+    double cpu_seconds(){
+        auto stat = proc("stat");
+        // the fields after the command name, which is in parentheses
+        std::istringstream in(stat.substr(stat.rfind(')') + 2));
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for(auto i = 3; i <= 15 && in >> field; ++i){
+            if(i == 14)
+                utime = std::stoull(field);
+            if(i == 15)
+                stime = std::stoull(field);
+        }
+        return static_cast<double>(utime + stime) / ::sysconf(_SC_CLK_TCK);
+    }
+    long peak_rss_kb(){
+        std::istringstream in(proc("status"));
+        std::string line;
+        while(std::getline(in, line)){
+            if(line.compare(0, 6, "VmHWM:") == 0)
+                return std::atol(line.c_str() + 6);
+        }
+        return 0;
+    }
+};
+
+struct Result{
+    Histogram latency_ns{};
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> requests{0};
+    std::atomic<std::uint64_t> connections{0};
+    std::atomic<std::uint64_t> errors{0};
+};
+
+void socks5_connect(boost::asio::ip::tcp::socket & socket, boost::asio::yield_context yield, unsigned short port){
+    unsigned char greeting[] = {0x05, 0x01, 0x00};
+    boost::asio::async_write(socket, boost::asio::buffer(greeting), yield);
+    unsigned char method[2];
+    boost::asio::async_read(socket, boost::asio::buffer(method), yield);
+    unsigned char request[] = {0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, static_cast<unsigned char>(port >> 8), static_cast<unsigned char>(port & 0xff)};
+    boost::asio::async_write(socket, boost::asio::buffer(request), yield);
+    unsigned char reply[10];
+    boost::asio::async_read(socket, boost::asio::buffer(reply), yield);
+    if(method[1] != 0x00 || reply[1] != 0x00)
+        throw std::runtime_error("SOCKS5 handshake refused");
+}
+
+void run_load(Config const & config, std::string const & mode, Payload const & payload, unsigned short forwarder_port, unsigned short sink_port, Result & result){
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), forwarder_port);
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<long>(config.duration * 1000));
+    std::mutex merge_mutex;
+    for(auto i = 0; i < config.concurrency; ++i){
+        boost::asio::spawn(io, [&](boost::asio::yield_context yield){
+            std::unique_ptr<Histogram> latency(new Histogram);
+            std::vector<char> buf(payload.response.size());
+            while(std::chrono::steady_clock::now() < end){
+                try{
+                    boost::asio::ip::tcp::socket socket(io);
+                    socket.async_connect(endpoint, yield);
+                    socket.set_option(boost::asio::ip::tcp::no_delay(true));
+                    if(mode == "socks5")
+                        socks5_connect(socket, yield, sink_port);
+                    result.connections.fetch_add(1, std::memory_order_relaxed);
+                    for(auto m = 0; (config.messages == 0 || m < config.messages) && std::chrono::steady_clock::now() < end; ++m){
+                        auto start = std::chrono::steady_clock::now();
+                        boost::asio::async_write(socket, boost::asio::buffer(payload.request), yield);
+                        boost::asio::async_read(socket, boost::asio::buffer(buf), yield);
+                        auto elapsed = std::chrono::steady_clock::now() - start;
+                        latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                        result.requests.fetch_add(1, std::memory_order_relaxed);
+                        result.bytes.fetch_add(payload.request.size() + payload.response.size(), std::memory_order_relaxed);
+                    }
+                }catch(std::exception const &){
+                    result.errors.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            result.latency_ns.merge(*latency);
+        });
+    }
+    boost::thread_group threads;
+    for(auto i = 1; i < config.client_threads; ++i){
+        threads.create_thread([&io](){
+            io.run();
+        });
+    }
+    io.run();
+    threads.join_all();
+}
+
+std::string run_mode(Config const & config, std::string const & mode){
+    Payload payload(mode, config.size);
+    Sink sink(payload, config.client_threads);
+    auto port = free_port();
+    std::vector<std::string> args;
+    if(mode == "filter")
+        args.push_back("--events=/dev/null");
+    else
+        args.push_back("--no-filter");
+    args.push_back("127.0.0.1");
+    args.push_back(std::to_string(port));
+    if(mode != "socks5"){
+        args.push_back("127.0.0.1");
+        args.push_back(std::to_string(sink.port()));
+    }
+    args.push_back(std::to_string(config.threads));
+    Forwarder forwarder(config.forwarder, args);
+    forwarder.wait_ready(port);
+
+    Result result;
+    auto cpu_before = forwarder.cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    run_load(config, mode, payload, port, sink.port(), result);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto cpu = forwarder.cpu_seconds() - cpu_before;
+    auto gigabytes = result.bytes.load() / 1e9;
+
+    std::ostringstream out;
+    out << "{\"mode\":\"" << mode << "\""
+        << ",\"concurrency\":" << config.concurrency
+        << ",\"size\":" << config.size
+        << ",\"messages_per_connection\":" << config.messages
+        << ",\"forwarder_threads\":" << config.threads
+        << ",\"duration_s\":" << seconds
+        << ",\"throughput_bytes_per_s\":" << result.bytes.load() / seconds
+        << ",\"requests_per_s\":" << result.requests.load() / seconds
+        << ",\"connections_per_s\":" << result.connections.load() / seconds
+        << ",\"latency_us\":{\"p50\":" << result.latency_ns.percentile(0.5) / 1e3
+        << ",\"p99\":" << result.latency_ns.percentile(0.99) / 1e3
+        << ",\"p999\":" << result.latency_ns.percentile(0.999) / 1e3
+        << ",\"max\":" << result.latency_ns.max() / 1e3 << "}"
+        << ",\"forwarder_cpu_s\":" << cpu
+        << ",\"cpu_s_per_gb\":" << (gigabytes > 0 ? cpu / gigabytes : 0)
+        << ",\"forwarder_peak_rss_kb\":" << forwarder.peak_rss_kb()
+        << ",\"errors\":" << result.errors.load()
+        << "}";
+    return out.str();
+}
+
+int main(int argc, char *argv[])
+{
+    try{
+        Config config;
+        for(auto i = 1; i < argc; ++i){
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            auto name = arg.substr(0, eq);
+            auto value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if(name == "--forwarder"){
+                config.forwarder = value;
+            }else if(name == "--modes"){
+                config.modes.clear();
+                std::istringstream in(value);
+                std::string mode;
+                while(std::getline(in, mode, ','))
+                    config.modes.push_back(mode);
+            }else if(name == "--concurrency"){
+                config.concurrency = std::atoi(value.c_str());
+            }else if(name == "--size"){
+                config.size = std::max(std::atol(value.c_str()), 1L);
+            }else if(name == "--messages"){
+                config.messages = std::atoi(value.c_str());
+            }else if(name == "--duration"){
+                config.duration = std::atof(value.c_str());
+            }else if(name == "--threads"){
+                config.threads = std::atoi(value.c_str());
+            }else if(name == "--client-threads"){
+                config.client_threads = std::max(std::atoi(value.c_str()), 1);
+            }else{
+                std::cout << "Usage: " << argv[0] << " [--forwarder=PATH] [--modes=accept,socks5,filter] [--concurrency=64] [--size=1024]" << std::endl;
+                std::cout << "       [--messages=100] [--duration=10] [--threads=1] [--client-threads=1]" << std::endl;
+                std::cout << "--messages is the number of round trips per connection before reconnecting, 0 never reconnects" << std::endl;
+                return 1;
+            }
+        }
+        signal(SIGPIPE, SIG_IGN);
+        for(auto const & mode : config.modes){
+            std::cerr << "running " << mode << "\n";
+            std::cout << run_mode(config, mode) << std::endl;
+        }
+        return 0;
+    }catch(std::exception const &e){
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+}
@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = port_forward_bench
+
+SOURCES += bench.cpp
+
+include(../common.pri)
+
+HEADERS += \
+    ../histogram.h
@@ -0,0 +1,172 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <boost/asio/buffer.hpp>
+
+/** Free lists of blocks in a few size classes, one set per thread, so the relay loop does not touch the allocator in steady state. */
+class BufferPool{
+    struct Block{
+        Block * next;
+    };
+public:
+    static const std::size_t header_size = 64;
+    static const std::size_t num_of_classes = 4;
+    // usable bytes of a block of class i is 4 KiB << (2 * i): 4 KiB, 16 KiB, 64 KiB, 256 KiB
+    static std::size_t class_capacity(std::size_t size_class){
+        return std::size_t(4096) << (2 * size_class);
+    }
+    static std::size_t block_size(std::size_t size_class){
+        return header_size + class_capacity(size_class);
+    }
+    // smallest class holding size bytes, the largest one when nothing does
+    static std::size_t class_of(std::size_t size){
+        std::size_t size_class = 0;
+        while(size_class + 1 < num_of_classes && class_capacity(size_class) < size){
+            ++size_class;
+        }
+        return size_class;
+    }
+private:
+    Block * free_[num_of_classes] = {};
+    std::size_t free_count_[num_of_classes] = {};
+
+    // blocks kept around per thread and class, about 4 MiB each, the rest goes back to the allocator
+    static std::size_t max_free(std::size_t size_class){
+        return std::size_t(1024) >> (2 * size_class);
+    }
+public:
+    BufferPool() = default;
+    BufferPool(BufferPool const &) = delete;
+    BufferPool & operator=(BufferPool const &) = delete;
+    ~BufferPool(){
+        for(auto & head : free_){
+            while(head){
+                auto block = head;
+                head = block->next;
+                ::operator delete(block);
+            }
+        }
+    }
+    static BufferPool & local(){
+        static thread_local BufferPool pool;
+        return pool;
+    }
+    void * allocate(std::size_t size_class){
+        if(free_[size_class]){
+            auto block = free_[size_class];
+            free_[size_class] = block->next;
+            --free_count_[size_class];
+            return block;
+        }
+        return ::operator new(block_size(size_class));
+    }
+    // the block may come from another thread's pool, blocks of one class are interchangeable
+    void deallocate(void * p, std::size_t size_class){
+        if(free_count_[size_class] >= max_free(size_class)){
+            ::operator delete(p);
+            return;
+        }
+        auto block = static_cast<Block *>(p);
+        block->next = free_[size_class];
+        free_[size_class] = block;
+        ++free_count_[size_class];
+    }
+};
+
+/** Reference counted handle to one pooled block, the block returns to the pool of the thread dropping the last reference. */
+class RelayBuffer{
+    struct Header{
+        std::atomic<std::size_t> refs;
+        std::size_t size_class;
+    };
+    static const std::size_t header_size = BufferPool::header_size;
+    static_assert(sizeof(Header) <= header_size, "header does not fit");
+    Header * header_ = nullptr;
+
+    void release(){
+        if(header_ && header_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            auto size_class = header_->size_class;
+            header_->~Header();
+            BufferPool::local().deallocate(header_, size_class);
+        }
+        header_ = nullptr;
+    }
+public:
+    static const std::size_t min_capacity = 4096;
+    static const std::size_t max_capacity = 256 * 1024;
+
+    RelayBuffer() = default;
+    RelayBuffer(RelayBuffer const & other):header_(other.header_){
+        if(header_)
+            header_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    RelayBuffer(RelayBuffer && other):header_(other.header_){
+        other.header_ = nullptr;
+    }
+    RelayBuffer & operator=(RelayBuffer other){
+        std::swap(header_, other.header_);
+        return *this;
+    }
+    ~RelayBuffer(){
+        release();
+    }
+    // a block of at least size bytes, capped at max_capacity
+    static RelayBuffer allocate(std::size_t size = min_capacity){
+        auto size_class = BufferPool::class_of(size);
+        RelayBuffer buf;
+        buf.header_ = new (BufferPool::local().allocate(size_class)) Header();
+        buf.header_->refs.store(1, std::memory_order_relaxed);
+        buf.header_->size_class = size_class;
+        return buf;
+    }
+    explicit operator bool() const{
+        return header_ != nullptr;
+    }
+    std::size_t capacity() const{
+        return BufferPool::class_capacity(header_->size_class);
+    }
+    char * data() const{
+        return reinterpret_cast<char *>(header_) + header_size;
+    }
+    boost::asio::mutable_buffers_1 buffer() const{
+        return boost::asio::buffer(data(), capacity());
+    }
+};
+
+/** Bytes of relay buffers queued by all the connections, against an optional limit.
+ *  Each thread batches its changes before touching the shared counter, so the count is
+ *  approximate by a few hundred KiB per thread. */
+class MemoryBudget{
+    std::atomic<long long> used_{0};
+    std::atomic<long long> limit_{0};
+    static const long long batch = 256 * 1024;
+public:
+    static MemoryBudget & instance(){
+        static MemoryBudget budget;
+        return budget;
+    }
+    // 0 is no limit
+    void set_limit(long long bytes){
+        limit_.store(bytes, std::memory_order_relaxed);
+    }
+    void charge(long long bytes){
+        static thread_local long long delta = 0;
+        delta += bytes;
+        if(delta >= batch || delta <= -batch){
+            used_.fetch_add(delta, std::memory_order_relaxed);
+            delta = 0;
+        }
+    }
+    long long used() const{
+        return used_.load(std::memory_order_relaxed);
+    }
+    bool exceeded() const{
+        auto limit = limit_.load(std::memory_order_relaxed);
+        return limit > 0 && used() >= limit;
+    }
+};
+
+#endif
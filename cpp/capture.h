@@ -0,0 +1,286 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// --capture: traffic recorded into a memory-mapped ring file, read by capture/port_forward_capture.
+// The file is a FileHeader, then one segment per relay thread. A segment is a SegmentHeader and a
+// ring of records, written by its thread alone, so appending is a copy and a release store.
+// Integers are in host byte order, records are 8 byte aligned and never wrap around the ring end.
+namespace capture{
+
+static const char magic[8] = {'P', 'F', 'C', 'A', 'P', 'T', 'R', '1'};
+static const std::uint32_t version = 1;
+
+struct FileHeader{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t segments;
+    // SegmentHeader included
+    std::uint64_t segment_size;
+    std::uint32_t snaplen;
+    std::uint32_t reserved;
+    std::uint64_t created_ns;
+    std::uint64_t padding[3];
+};
+static_assert(sizeof(FileHeader) == 64, "capture file header layout");
+
+// byte offsets since the segment was created, the ring position is offset % capacity.
+// [tail, head) are complete records; the writer moves tail on before overwriting, so a reader
+// drops what it copied from below the tail it sees afterwards
+struct SegmentHeader{
+    std::atomic<std::uint64_t> head;
+    std::atomic<std::uint64_t> tail;
+    std::uint64_t padding[6];
+};
+static_assert(sizeof(SegmentHeader) == 64, "capture segment header layout");
+
+enum RecordType : std::uint16_t{
+    // fills the end of the ring when the next record does not fit
+    record_pad = 0,
+    // payload: Endpoint client, Endpoint upstream
+    record_open = 1,
+    // payload: std::uint32_t length relayed, std::uint32_t captured, then the first captured bytes of it
+    record_data = 2,
+    record_close = 3,
+};
+
+struct RecordHeader{
+    // header and payload, rounded up to 8
+    std::uint32_t size;
+    std::uint16_t type;
+    // record_data: 0 client to upstream, 1 upstream to client
+    std::uint16_t direction;
+    // segment index << 48 | sequence in the segment, never 0
+    std::uint64_t connection;
+    // system clock
+    std::uint64_t time_ns;
+};
+static_assert(sizeof(RecordHeader) == 24, "capture record header layout");
+
+struct Endpoint{
+    // 0 unknown, 4 or 6
+    std::uint8_t family;
+    std::uint8_t reserved;
+    std::uint16_t port;
+    std::uint8_t address[16];
+
+    static Endpoint from(boost::asio::ip::tcp::endpoint const & endpoint){
+        Endpoint result{};
+        result.port = endpoint.port();
+        auto address = endpoint.address();
+        if(address.is_v4()){
+            result.family = 4;
+            auto bytes = address.to_v4().to_bytes();
+            std::memcpy(result.address, bytes.data(), bytes.size());
+        }else{
+            result.family = 6;
+            auto bytes = address.to_v6().to_bytes();
+            std::memcpy(result.address, bytes.data(), bytes.size());
+        }
+        return result;
+    }
+    std::string to_string() const{
+        if(family == 4){
+            boost::asio::ip::address_v4::bytes_type bytes;
+            std::memcpy(bytes.data(), address, bytes.size());
+            return boost::asio::ip::address_v4(bytes).to_string() + ":" + std::to_string(port);
+        }
+        if(family == 6){
+            boost::asio::ip::address_v6::bytes_type bytes;
+            std::memcpy(bytes.data(), address, bytes.size());
+            return "[" + boost::asio::ip::address_v6(bytes).to_string() + "]:" + std::to_string(port);
+        }
+        return "-";
+    }
+};
+static_assert(sizeof(Endpoint) == 20, "capture endpoint layout");
+
+static inline std::uint64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+static inline std::uint32_t record_size(std::size_t payload){
+    return static_cast<std::uint32_t>((sizeof(RecordHeader) + payload + 7) & ~std::size_t(7));
+}
+
+/** Appends records to one segment; only the thread owning the segment may call it. */
+class SegmentWriter{
+    SegmentHeader * header_ = nullptr;
+    char * ring_ = nullptr;
+    std::uint64_t capacity_ = 0;
+    std::uint64_t index_ = 0;
+    std::uint64_t sequence_ = 0;
+    std::uint32_t snaplen_ = 0;
+
+    // drops the oldest records until [.., end) fits
+    void make_room(std::uint64_t end){
+        auto tail = header_->tail.load(std::memory_order_relaxed);
+        if(end - tail <= capacity_)
+            return;
+        while(end - tail > capacity_){
+            RecordHeader oldest;
+            std::memcpy(&oldest, ring_ + tail % capacity_, 8);
+            tail += oldest.size;
+        }
+        header_->tail.store(tail, std::memory_order_release);
+        // the records are overwritten only after the new tail is visible
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    // room for size bytes at the returned position, published by commit()
+    char * reserve(std::uint32_t size, std::uint64_t & head){
+        head = header_->head.load(std::memory_order_relaxed);
+        auto left = capacity_ - head % capacity_;
+        if(left < size){
+            make_room(head + left);
+            RecordHeader pad{};
+            pad.size = static_cast<std::uint32_t>(left);
+            pad.type = record_pad;
+            std::memcpy(ring_ + head % capacity_, &pad, 8);
+            head += left;
+            header_->head.store(head, std::memory_order_release);
+        }
+        make_room(head + size);
+        return ring_ + head % capacity_;
+    }
+    void commit(std::uint64_t head, std::uint32_t size){
+        header_->head.store(head + size, std::memory_order_release);
+    }
+    char * begin(RecordType type, std::uint64_t connection, std::size_t payload, std::uint16_t direction, std::uint64_t & head){
+        RecordHeader record{};
+        record.size = record_size(payload);
+        record.type = type;
+        record.direction = direction;
+        record.connection = connection;
+        record.time_ns = now_ns();
+        auto at = reserve(record.size, head);
+        std::memcpy(at, &record, sizeof(record));
+        return at + sizeof(record);
+    }
+public:
+    SegmentWriter(SegmentHeader * header, std::uint64_t capacity, std::uint64_t index, std::uint32_t snaplen)
+        : header_(header), ring_(reinterpret_cast<char *>(header + 1)), capacity_(capacity), index_(index), snaplen_(snaplen){
+    }
+    // a new connection id
+    std::uint64_t open(boost::asio::ip::tcp::endpoint const & client, boost::asio::ip::tcp::endpoint const & upstream){
+        auto connection = index_ << 48 | ++sequence_;
+        Endpoint endpoints[2] = {Endpoint::from(client), Endpoint::from(upstream)};
+        std::uint64_t head;
+        auto payload = begin(record_open, connection, sizeof(endpoints), 0, head);
+        std::memcpy(payload, endpoints, sizeof(endpoints));
+        commit(head, record_size(sizeof(endpoints)));
+        return connection;
+    }
+    // data null: the bytes did not pass through user space, only length is recorded
+    void data(std::uint64_t connection, int direction, char const * data, std::size_t length){
+        auto captured = data ? std::min<std::size_t>(length, snaplen_) : 0;
+        std::uint32_t lengths[2] = {static_cast<std::uint32_t>(std::min<std::size_t>(length, UINT32_MAX)), static_cast<std::uint32_t>(captured)};
+        std::uint64_t head;
+        auto payload = begin(record_data, connection, sizeof(lengths) + captured, static_cast<std::uint16_t>(direction), head);
+        std::memcpy(payload, lengths, sizeof(lengths));
+        if(captured > 0)
+            std::memcpy(payload + sizeof(lengths), data, captured);
+        commit(head, record_size(sizeof(lengths) + captured));
+    }
+    void close(std::uint64_t connection){
+        std::uint64_t head;
+        begin(record_close, connection, 0, 0, head);
+        commit(head, record_size(0));
+    }
+};
+
+/** The ring file. Configured once before the relay threads start; each thread claims the next
+ *  free segment the first time it records, threads past the last segment record nothing. */
+class Capture{
+    void * map_ = MAP_FAILED;
+    std::size_t map_size_ = 0;
+    std::uint32_t segments_ = 0;
+    std::uint64_t segment_size_ = 0;
+    std::uint32_t snaplen_ = 0;
+    std::vector<SegmentWriter> writers_{};
+    std::atomic<std::uint32_t> claimed_{0};
+
+    Capture() = default;
+    SegmentWriter * claim(){
+        auto index = claimed_.fetch_add(1);
+        return index < writers_.size() ? &writers_[index] : nullptr;
+    }
+public:
+    static const std::uint32_t max_snaplen = 65536;
+    Capture(Capture const &) = delete;
+    Capture & operator=(Capture const &) = delete;
+    ~Capture(){
+        if(map_ != MAP_FAILED)
+            ::munmap(map_, map_size_);
+    }
+    static Capture & instance(){
+        static Capture capture;
+        return capture;
+    }
+    // size: of the whole file, split evenly between the segments; snaplen: payload bytes kept per read, 0 none
+    void open(std::string const & path, std::size_t size, std::uint32_t segments, std::uint32_t snaplen){
+        segments = std::max<std::uint32_t>(segments, 1);
+        snaplen = std::min(snaplen, max_snaplen);
+        auto segment_size = (size - std::min(size, sizeof(FileHeader))) / segments & ~std::uint64_t(4095);
+        // a segment holds a few records of the largest kind at least
+        if(segment_size < sizeof(SegmentHeader) + 4 * record_size(8 + snaplen))
+            throw std::invalid_argument("capture file too small for " + std::to_string(segments) + " threads");
+        auto map_size = sizeof(FileHeader) + segments * segment_size;
+        // a new file, the process this one takes over from may still be writing to the old one
+        ::unlink(path.c_str());
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0)
+            throw std::runtime_error("can not open capture file " + path + ": " + std::strerror(errno));
+        void * map = MAP_FAILED;
+        if(::ftruncate(fd, map_size) == 0)
+            map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        auto error = errno;
+        ::close(fd);
+        if(map == MAP_FAILED)
+            throw std::runtime_error("can not map capture file " + path + ": " + std::strerror(error));
+        map_ = map;
+        map_size_ = map_size;
+        segments_ = segments;
+        segment_size_ = segment_size;
+        snaplen_ = snaplen;
+        for(std::uint32_t i = 0; i < segments; ++i){
+            auto segment = reinterpret_cast<SegmentHeader *>(static_cast<char *>(map_) + sizeof(FileHeader) + i * segment_size);
+            writers_.emplace_back(segment, segment_size - sizeof(SegmentHeader), i, snaplen);
+        }
+        // a fresh file reads as zeros: empty segments
+        FileHeader header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.segments = segments;
+        header.segment_size = segment_size;
+        header.snaplen = snaplen;
+        header.created_ns = now_ns();
+        std::memcpy(map_, &header, sizeof(header));
+    }
+    // the calling thread's writer, null when capture is off or every segment is taken
+    static SegmentWriter * local(){
+        static thread_local SegmentWriter * writer = nullptr;
+        static thread_local bool claimed = false;
+        if(! claimed){
+            auto & capture = instance();
+            if(capture.map_ == MAP_FAILED)
+                return nullptr;
+            claimed = true;
+            writer = capture.claim();
+        }
+        return writer;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,268 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstddef>
+#include <ctime>
+#include <boost/asio.hpp>
+#include "../capture.h"
+
+// reads the ring file written by port_forward --capture: lists the connections in it, dumps or
+// extracts the bytes of one, or replays its client side against a server
+
+struct Record{
+    capture::RecordHeader header;
+    std::string payload;
+};
+
+struct Connection{
+    std::uint64_t id = 0;
+    // the open record may already be overwritten
+    bool opened = false;
+    bool closed = false;
+    std::uint64_t first_ns = 0;
+    std::uint64_t last_ns = 0;
+    capture::Endpoint client{};
+    capture::Endpoint upstream{};
+    std::uint64_t bytes[2] = {0, 0};
+    std::uint64_t captured[2] = {0, 0};
+    // record_data only, in the order written
+    std::vector<Record> data{};
+};
+
+class CaptureFile{
+    std::vector<char> file_{};
+    capture::FileHeader header_{};
+    // of every segment, read again after the copy
+    std::vector<std::uint64_t> tails_{};
+public:
+    explicit CaptureFile(std::string const & path){
+        // a copy, so the forwarder may keep writing: the records below the tails read after it may
+        // have been overwritten while copying and are left out
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw std::runtime_error("can not open " + path + ": " + std::strerror(errno));
+        char buf[65536];
+        ssize_t n;
+        while((n = ::read(fd, buf, sizeof(buf))) > 0)
+            file_.insert(file_.end(), buf, buf + n);
+        if(file_.size() < sizeof(header_)){
+            ::close(fd);
+            throw std::runtime_error(path + " is not a capture file");
+        }
+        std::memcpy(&header_, file_.data(), sizeof(header_));
+        if(std::memcmp(header_.magic, capture::magic, sizeof(capture::magic)) == 0 && file_.size() >= sizeof(header_) + header_.segments * header_.segment_size){
+            for(std::uint32_t i = 0; i < header_.segments; ++i){
+                std::uint64_t tail = 0;
+                auto offset = sizeof(header_) + i * header_.segment_size + offsetof(capture::SegmentHeader, tail);
+                if(::pread(fd, &tail, sizeof(tail), offset) != sizeof(tail))
+                    std::memcpy(&tail, file_.data() + offset, sizeof(tail));
+                tails_.push_back(tail);
+            }
+        }
+        ::close(fd);
+        if(std::memcmp(header_.magic, capture::magic, sizeof(capture::magic)) != 0 || header_.version != capture::version)
+            throw std::runtime_error(path + " is not a capture file of this version");
+        if(tails_.size() != header_.segments)
+            throw std::runtime_error(path + " is truncated");
+    }
+    capture::FileHeader const & header() const{
+        return header_;
+    }
+    // every record still in the ring, segment by segment, oldest first
+    std::vector<Record> records() const{
+        std::vector<Record> result;
+        auto capacity = header_.segment_size - sizeof(capture::SegmentHeader);
+        for(std::uint32_t i = 0; i < header_.segments; ++i){
+            auto segment = file_.data() + sizeof(header_) + i * header_.segment_size;
+            std::uint64_t head, tail;
+            std::memcpy(&head, segment + offsetof(capture::SegmentHeader, head), sizeof(head));
+            std::memcpy(&tail, segment + offsetof(capture::SegmentHeader, tail), sizeof(tail));
+            tail = std::max(tail, tails_[i]);
+            auto ring = segment + sizeof(capture::SegmentHeader);
+            while(tail < head){
+                Record record;
+                std::memcpy(&record.header, ring + tail % capacity, 8);
+                if(record.header.size < 8 || record.header.size > capacity - tail % capacity)
+                    throw std::runtime_error("corrupt record in segment " + std::to_string(i));
+                if(record.header.type != capture::record_pad){
+                    std::memcpy(&record.header, ring + tail % capacity, sizeof(record.header));
+                    auto payload = ring + tail % capacity + sizeof(record.header);
+                    record.payload.assign(payload, record.header.size - sizeof(record.header));
+                    result.push_back(std::move(record));
+                }
+                tail += record.header.size;
+            }
+        }
+        return result;
+    }
+};
+
+static std::string format_time(std::uint64_t ns){
+    std::time_t seconds = ns / 1000000000;
+    std::tm tm;
+    ::gmtime_r(&seconds, &tm);
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::ostringstream out;
+    out << text << "." << std::setw(6) << std::setfill('0') << ns / 1000 % 1000000 << "Z";
+    return out.str();
+}
+
+static std::map<std::uint64_t, Connection> connections(std::vector<Record> && records){
+    std::map<std::uint64_t, Connection> result;
+    // a connection may span segments when its handlers ran on more than one thread
+    std::stable_sort(records.begin(), records.end(), [](Record const & a, Record const & b){
+        return a.header.time_ns < b.header.time_ns;
+    });
+    for(auto & record : records){
+        auto & connection = result[record.header.connection];
+        connection.id = record.header.connection;
+        if(connection.first_ns == 0)
+            connection.first_ns = record.header.time_ns;
+        connection.last_ns = record.header.time_ns;
+        if(record.header.type == capture::record_open && record.payload.size() >= 2 * sizeof(capture::Endpoint)){
+            connection.opened = true;
+            std::memcpy(&connection.client, record.payload.data(), sizeof(capture::Endpoint));
+            std::memcpy(&connection.upstream, record.payload.data() + sizeof(capture::Endpoint), sizeof(capture::Endpoint));
+        }else if(record.header.type == capture::record_close){
+            connection.closed = true;
+        }else if(record.header.type == capture::record_data && record.payload.size() >= 8 && record.header.direction < 2){
+            std::uint32_t lengths[2];
+            std::memcpy(lengths, record.payload.data(), sizeof(lengths));
+            auto length = lengths[0];
+            auto captured = std::min<std::size_t>(lengths[1], record.payload.size() - 8);
+            record.payload = record.payload.substr(8, captured);
+            record.header.size = length;
+            connection.bytes[record.header.direction] += length;
+            connection.captured[record.header.direction] += captured;
+            connection.data.push_back(std::move(record));
+        }
+    }
+    return result;
+}
+
+static void list(std::map<std::uint64_t, Connection> const & connections){
+    std::cout << "connection\topened\tclient\tupstream\tbytes_up\tbytes_down\tcaptured_up\tcaptured_down\tstate" << std::endl;
+    for(auto const & item : connections){
+        auto const & c = item.second;
+        std::cout << c.id << "\t" << format_time(c.first_ns) << "\t" << c.client.to_string() << "\t" << c.upstream.to_string()
+                  << "\t" << c.bytes[0] << "\t" << c.bytes[1] << "\t" << c.captured[0] << "\t" << c.captured[1]
+                  << "\t" << (c.closed ? "closed" : "open") << (c.opened ? "" : ",partial") << std::endl;
+    }
+}
+
+// one line per read, payload escaped
+static void dump(Connection const & connection){
+    for(auto const & record : connection.data){
+        std::cout << format_time(record.header.time_ns) << (record.header.direction == 0 ? " > " : " < ") << record.header.size << " ";
+        for(unsigned char c : record.payload){
+            if(c == '\\'){
+                std::cout << "\\\\";
+            }else if(c >= 0x20 && c < 0x7f){
+                std::cout << c;
+            }else{
+                std::cout << "\\x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            }
+        }
+        if(record.payload.size() < record.header.size)
+            std::cout << " ...";
+        std::cout << "\n";
+    }
+}
+
+static void extract(Connection const & connection, int direction){
+    for(auto const & record : connection.data){
+        if(record.header.direction == direction)
+            std::cout.write(record.payload.data(), record.payload.size());
+    }
+}
+
+// sends the captured client bytes to target in order, the server's answer goes to stdout
+static void replay(Connection const & connection, std::string const & target){
+    if(connection.captured[0] < connection.bytes[0])
+        std::cerr << "WARNING : only " << connection.captured[0] << " of " << connection.bytes[0] << " bytes were captured, see --capture-snaplen" << std::endl;
+    auto colon = target.rfind(':');
+    if(colon == std::string::npos)
+        throw std::invalid_argument("--to needs host:port, got " + target);
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::resolver resolver(io);
+    boost::asio::ip::tcp::socket socket(io);
+    boost::asio::connect(socket, resolver.resolve(boost::asio::ip::tcp::resolver::query(target.substr(0, colon), target.substr(colon + 1))));
+    for(auto const & record : connection.data){
+        if(record.header.direction == 0)
+            boost::asio::write(socket, boost::asio::buffer(record.payload));
+    }
+    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send);
+    char buf[65536];
+    boost::system::error_code ec;
+    while(true){
+        auto n = socket.read_some(boost::asio::buffer(buf), ec);
+        if(ec)
+            break;
+        std::cout.write(buf, n);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try{
+        std::string path, to;
+        std::string action = "list";
+        std::uint64_t id = 0;
+        int direction = 0;
+        for(auto i = 1; i < argc; ++i){
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            auto name = arg.substr(0, eq);
+            auto value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if(name == "--dump" || name == "--extract" || name == "--replay"){
+                action = name.substr(2);
+                id = std::strtoull(value.c_str(), nullptr, 10);
+            }else if(arg == "--direction=up"){
+                direction = 0;
+            }else if(arg == "--direction=down"){
+                direction = 1;
+            }else if(name == "--to"){
+                to = value;
+            }else if(path.empty() && arg.compare(0, 2, "--") != 0){
+                path = arg;
+            }else{
+                path.clear();
+                break;
+            }
+        }
+        if(path.empty() || (action == "replay" && to.empty())){
+            std::cout << "Usage: " << argv[0] << " FILE                      list the connections in the capture" << std::endl;
+            std::cout << "       " << argv[0] << " FILE --dump=ID            every read of a connection, escaped" << std::endl;
+            std::cout << "       " << argv[0] << " FILE --extract=ID [--direction=up|down]  the captured bytes, raw" << std::endl;
+            std::cout << "       " << argv[0] << " FILE --replay=ID --to=HOST:PORT  send the client side again, print the answer" << std::endl;
+            return 1;
+        }
+        CaptureFile file(path);
+        auto all = connections(file.records());
+        if(action == "list"){
+            list(all);
+            return 0;
+        }
+        auto found = all.find(id);
+        if(found == all.end()){
+            std::cerr << "no connection " << id << " in " << path << std::endl;
+            return 1;
+        }
+        if(action == "dump"){
+            dump(found->second);
+        }else if(action == "extract"){
+            extract(found->second, direction);
+        }else{
+            replay(found->second, to);
+        }
+        return 0;
+    }catch(std::exception const &e){
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+}
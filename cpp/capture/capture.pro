@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = port_forward_capture
+
+SOURCES += capture.cpp
+
+include(../common.pri)
+
+HEADERS += \
+    ../capture.h
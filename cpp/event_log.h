@@ -0,0 +1,253 @@
+#ifndef _EVENT_LOG_H_
+#define _EVENT_LOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/** A matched download, pushed by the relay threads. */
+struct DownloadEvent{
+    std::chrono::system_clock::time_point time{};
+    // request line and headers of the original (pre-redirect) request
+    std::string request{};
+};
+
+/** Bounded lock-free queue, many producers and one consumer (Vyukov's bounded queue). */
+template<typename T>
+class MpscRing{
+    struct Slot{
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(64) std::size_t dequeue_pos_ = 0;
+public:
+    // capacity is rounded up to a power of two
+    explicit MpscRing(std::size_t capacity){
+        std::size_t size = 2;
+        while(size < capacity)
+            size <<= 1;
+        slots_.reset(new Slot[size]);
+        mask_ = size - 1;
+        for(std::size_t i = 0; i < size; ++i){
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    // false when full, the value is left untouched
+    bool try_push(T && value){
+        auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Slot * slot;
+        while(true){
+            slot = &slots_[pos & mask_];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if(diff == 0){
+                if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }else if(diff < 0){
+                return false;
+            }else{
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    // consumer side only
+    bool try_pop(T & value){
+        auto & slot = slots_[dequeue_pos_ & mask_];
+        if(slot.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1)
+            return false;
+        value = std::move(slot.value);
+        slot.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+        ++dequeue_pos_;
+        return true;
+    }
+};
+
+static inline std::string shell_quote(boost::string_ref src){
+    std::string out{"'"};
+    for(auto c : src){
+        if(c == '\'')
+            out += R"a('"'"')a";
+        else
+            out += c;
+    }
+    out += "'";
+    return out;
+}
+
+static inline std::string json_quote(boost::string_ref src){
+    static const char hex[] = "0123456789abcdef";
+    std::string out{"\""};
+    for(auto c : src){
+        auto u = static_cast<unsigned char>(c);
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        }else if(u < 0x20){
+            out += "\\u00";
+            out += hex[u >> 4];
+            out += hex[u & 0xf];
+        }else{
+            out += c;
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+/** Url and header lines of a request captured by RequestFilter. */
+struct ParsedRequest{
+    std::string url{};
+    // "Name: value" lines, Host excluded
+    std::vector<boost::string_ref> headers{};
+
+    explicit ParsedRequest(boost::string_ref in){
+        std::string path, host;
+        auto first = true;
+        while(! in.empty()){
+            auto eol = in.find("\r\n");
+            auto line = in.substr(0, eol);
+            in.remove_prefix(eol == boost::string_ref::npos ? in.size() : eol + 2);
+            if(first){
+                first = false;
+                auto target = line.substr(line.find(' ') + 1);
+                path = target.substr(0, target.find(' ')).to_string();
+                continue;
+            }
+            auto colon = line.find(": ");
+            if(colon == 0 || colon == boost::string_ref::npos || colon + 2 == line.size())
+                continue;
+            if(line.substr(0, colon) == "Host"){
+                host = line.substr(colon + 2).to_string();
+            }else{
+                headers.push_back(line);
+            }
+        }
+        url = "http://" + host + path;
+    }
+};
+
+static inline std::string convert_request_to_curl_cmd(boost::string_ref in){
+    ParsedRequest request(in);
+    std::ostringstream out;
+    out << "curl " << shell_quote(request.url) << " ";
+    for(auto const & header : request.headers){
+        out << "-H " << shell_quote(header) << " ";
+    }
+    out << "--compressed ";
+    return out.str();
+}
+
+/** Writes download events from a background thread, so a slow consumer of the output never
+ *  stalls the relay. Producers only touch a lock-free ring; when it is full the event is dropped
+ *  and counted. */
+class EventLog{
+public:
+    enum class Format{curl, json};
+private:
+    MpscRing<DownloadEvent> ring_{4096};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+    std::unique_ptr<std::ofstream> file_{};
+    std::ostream * out_ = &std::cout;
+    Format format_ = Format::curl;
+    boost::thread thread_{};
+
+    void format(std::string & batch, DownloadEvent const & event){
+        if(format_ == Format::curl){
+            batch += convert_request_to_curl_cmd(event.request);
+            batch += "\n\n";
+            return;
+        }
+        ParsedRequest request(event.request);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(event.time.time_since_epoch()).count();
+        batch += "{\"time\":" + std::to_string(ms);
+        batch += ",\"url\":" + json_quote(request.url);
+        batch += ",\"headers\":[";
+        for(std::size_t i = 0; i < request.headers.size(); ++i){
+            if(i)
+                batch += ",";
+            batch += json_quote(request.headers[i]);
+        }
+        batch += "],\"curl\":" + json_quote(convert_request_to_curl_cmd(event.request)) + "}\n";
+    }
+    void run(){
+        std::string batch;
+        DownloadEvent event;
+        std::uint64_t reported_drops = 0;
+        auto idle = std::chrono::milliseconds(1);
+        while(true){
+            // grab what is queued, then write and flush it in one go
+            auto stopping = stop_.load(std::memory_order_acquire);
+            while(batch.size() < 64 * 1024 && ring_.try_pop(event)){
+                format(batch, event);
+            }
+            auto drops = dropped_.load(std::memory_order_relaxed);
+            if(drops != reported_drops){
+                std::cerr << "EventLog: dropped " << drops - reported_drops << " events\n";
+                reported_drops = drops;
+            }
+            if(! batch.empty()){
+                out_->write(batch.data(), batch.size());
+                out_->flush();
+                batch.clear();
+                idle = std::chrono::milliseconds(1);
+                continue;
+            }
+            if(stopping)
+                break;
+            std::this_thread::sleep_for(idle);
+            idle = std::min(idle * 2, std::chrono::milliseconds(50));
+        }
+    }
+public:
+    static EventLog & instance(){
+        static EventLog log;
+        return log;
+    }
+    ~EventLog(){
+        stop();
+    }
+    // path empty: stdout. a fifo works as well as a regular file
+    void start(std::string const & path, Format format){
+        if(! path.empty()){
+            file_.reset(new std::ofstream(path, std::ios::out | std::ios::app | std::ios::binary));
+            if(! *file_)
+                throw std::runtime_error("failed to open event output " + path);
+            out_ = file_.get();
+        }
+        format_ = format;
+        thread_ = boost::thread([this](){
+            run();
+        });
+    }
+    // drains what is queued
+    void stop(){
+        stop_.store(true, std::memory_order_release);
+        if(thread_.joinable())
+            thread_.join();
+    }
+    void push(DownloadEvent && event){
+        if(! ring_.try_push(std::move(event)))
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::uint64_t dropped() const{
+        return dropped_.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern char ** environ;
+
+/** Listening sockets passed on from one port_forward process to the next, so a restart keeps the
+ *  listen queues and loses no connection. They come from systemd socket activation (LISTEN_FDS)
+ *  or from the running process over a unix socket (see handover::receive), and are handed out to
+ *  the listeners bound to the same address. */
+class Listeners{
+    std::mutex mutex_{};
+    std::vector<int> inherited_{};
+    std::vector<bool> taken_{};
+    // every listener of this process, what a successor receives
+    std::vector<int> active_{};
+
+    static bool bound_to(int fd, boost::asio::ip::tcp::endpoint const & endpoint){
+        boost::asio::ip::tcp::endpoint local;
+        socklen_t size = local.capacity();
+        if(::getsockname(fd, local.data(), &size) != 0)
+            return false;
+        local.resize(size);
+        return local == endpoint;
+    }
+public:
+    static Listeners & instance(){
+        static Listeners listeners;
+        return listeners;
+    }
+    // sockets that are not listening are closed
+    void inherit(std::vector<int> const & fds){
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(auto fd : fds){
+            int listening = 0;
+            socklen_t size = sizeof(listening);
+            if(::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) != 0 || ! listening){
+                ::close(fd);
+                continue;
+            }
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            inherited_.push_back(fd);
+            taken_.push_back(false);
+        }
+    }
+    // a listening socket bound to endpoint, owned by the caller: an inherited one not taken yet,
+    // or a duplicate of one when there are more shards than inherited sockets; -1 when none is bound there
+    int take(boost::asio::ip::tcp::endpoint const & endpoint){
+        std::lock_guard<std::mutex> lock(mutex_);
+        int shared = -1;
+        for(std::size_t i = 0; i < inherited_.size(); ++i){
+            if(! bound_to(inherited_[i], endpoint))
+                continue;
+            if(! taken_[i]){
+                taken_[i] = true;
+                return inherited_[i];
+            }
+            shared = inherited_[i];
+        }
+        return shared < 0 ? -1 : ::fcntl(shared, F_DUPFD_CLOEXEC, 0);
+    }
+    // inherited sockets bound to endpoint and not taken yet, each needs a listener of its own
+    std::size_t untaken(boost::asio::ip::tcp::endpoint const & endpoint){
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t count = 0;
+        for(std::size_t i = 0; i < inherited_.size(); ++i){
+            if(! taken_[i] && bound_to(inherited_[i], endpoint))
+                ++count;
+        }
+        return count;
+    }
+    // inherited and not taken by now: bound to addresses no longer served
+    void close_untaken(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(std::size_t i = 0; i < inherited_.size(); ++i){
+            if(! taken_[i])
+                ::close(inherited_[i]);
+        }
+        inherited_.clear();
+        taken_.clear();
+    }
+    void add(int fd){
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_.push_back(fd);
+    }
+    std::vector<int> active(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return active_;
+    }
+};
+
+namespace handover{
+
+// environment variable naming the socket connected to the predecessor of a process started by SIGHUP
+static const char * const environment_fd = "PORT_FORWARD_HANDOVER_FD";
+static const std::size_t max_fds = 253;
+
+// systemd socket activation, the variables are removed so they are not passed on
+static inline std::vector<int> systemd_listeners(){
+    std::vector<int> fds;
+    auto pid = std::getenv("LISTEN_PID");
+    auto count = std::getenv("LISTEN_FDS");
+    if(pid && count && std::atol(pid) == ::getpid()){
+        // SD_LISTEN_FDS_START
+        for(int i = 0; i < std::atoi(count); ++i)
+            fds.push_back(3 + i);
+    }
+    ::unsetenv("LISTEN_PID");
+    ::unsetenv("LISTEN_FDS");
+    ::unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+// the connection to the running process: inherited through SIGHUP, else connected to path; -1 when there is none
+static inline int connect(std::string const & path){
+    if(auto inherited = std::getenv(environment_fd)){
+        int fd = std::atoi(inherited);
+        ::unsetenv(environment_fd);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+    sockaddr_un address{};
+    if(path.empty() || path.size() >= sizeof(address.sun_path))
+        return -1;
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.data(), path.size());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    if(::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0){
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// the file argv0 started, as an absolute path resolved now: a bare name is looked up in PATH like
+// execvp did, a relative one against the current directory. Symbolic links are kept, so a restart
+// runs whatever the path names by then; /proc/self/exe would be the binary already running
+static inline std::string executable_path(std::string const & argv0){
+    if(argv0.find('/') == std::string::npos){
+        auto path = std::getenv("PATH");
+        std::string directories = path ? path : "/usr/local/bin:/usr/bin:/bin";
+        std::size_t begin = 0;
+        while(begin <= directories.size()){
+            auto end = std::min(directories.find(':', begin), directories.size());
+            // an empty entry is the current directory
+            auto directory = begin == end ? std::string(".") : directories.substr(begin, end - begin);
+            auto candidate = directory + "/" + argv0;
+            if(::access(candidate.c_str(), X_OK) == 0)
+                return executable_path(candidate);
+            begin = end + 1;
+        }
+    }else if(argv0.front() == '/'){
+        return argv0;
+    }else{
+        char cwd[PATH_MAX];
+        if(::getcwd(cwd, sizeof(cwd)))
+            return std::string(cwd) + "/" + argv0;
+    }
+    // not found the way it was started, the running binary's path is the best guess
+    char self[PATH_MAX];
+    auto n = ::readlink("/proc/self/exe", self, sizeof(self) - 1);
+    return n > 0 ? std::string(self, n) : argv0;
+}
+
+// one message: the number of sockets in its byte, the sockets as SCM_RIGHTS
+static inline bool send(int socket, std::vector<int> fds){
+    fds.resize(std::min(fds.size(), max_fds));
+    unsigned char count = static_cast<unsigned char>(fds.size());
+    iovec iov{&count, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * std::max<std::size_t>(fds.size(), 1)));
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if(! fds.empty()){
+        message.msg_control = control.data();
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+    }
+    ssize_t n;
+    while((n = ::sendmsg(socket, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR){
+    }
+    return n == 1;
+}
+
+// blocks for the message of send()
+static inline std::vector<int> receive(int socket){
+    unsigned char count = 0;
+    iovec iov{&count, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    ssize_t n;
+    while((n = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR){
+    }
+    std::vector<int> fds;
+    if(n != 1)
+        return fds;
+    for(auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)){
+        if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            continue;
+        auto first = fds.size();
+        fds.resize(first + (header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        std::memcpy(fds.data() + first, CMSG_DATA(header), (fds.size() - first) * sizeof(int));
+    }
+    return fds;
+}
+
+// starts args[0] with args and the environment of this process, connected to the returned socket
+// through environment_fd; -1 when it could not be started
+static inline int spawn(std::vector<std::string> const & args){
+    int pair[2];
+    if(args.empty() || ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+        return -1;
+    // everything is allocated before fork(), the child only makes system calls
+    std::vector<char *> argv;
+    for(auto const & arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    std::vector<std::string> environment{std::string(environment_fd) + "=3"};
+    for(auto variable = environ; *variable; ++variable){
+        if(std::strncmp(*variable, environment_fd, std::strlen(environment_fd)) != 0)
+            environment.push_back(*variable);
+    }
+    std::vector<char *> envp;
+    for(auto const & variable : environment)
+        envp.push_back(const_cast<char *>(variable.c_str()));
+    envp.push_back(nullptr);
+    long max_fd = ::sysconf(_SC_OPEN_MAX);
+    auto pid = ::fork();
+    if(pid == 0){
+        // the connections of this process must not outlive it in the child
+        if(pair[1] == 3 ? ::fcntl(3, F_SETFD, 0) < 0 : ::dup2(pair[1], 3) < 0)
+            ::_exit(127);
+#ifdef SYS_close_range
+        if(::syscall(SYS_close_range, 4, ~0U, 0) != 0)
+#endif
+        for(long fd = 4; fd < max_fd; ++fd)
+            ::close(fd);
+        sigset_t none;
+        sigemptyset(&none);
+        ::sigprocmask(SIG_SETMASK, &none, nullptr);
+        ::execve(argv[0], argv.data(), envp.data());
+        ::_exit(127);
+    }
+    ::close(pair[1]);
+    if(pid < 0){
+        ::close(pair[0]);
+        return -1;
+    }
+    return pair[0];
+}
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/** Log-linear histogram (HDR style): 16 sub-buckets per power of two, about 6% relative error,
+ *  fixed size and no allocation. One thread records, any thread may read or merge. */
+class Histogram{
+public:
+    static const std::size_t num_of_buckets = 32 + 59 * 16;
+private:
+    std::array<std::atomic<std::uint64_t>, num_of_buckets> counts_;
+    std::atomic<std::uint64_t> total_{0};
+    std::atomic<std::uint64_t> sum_{0};
+    std::atomic<std::uint64_t> max_{0};
+
+    static int msb(std::uint64_t v){
+        return 63 - __builtin_clzll(v);
+    }
+    static void bump(std::atomic<std::uint64_t> & counter, std::uint64_t n){
+        // single writer, a plain load and store is enough
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+public:
+    Histogram(){
+        for(auto & count : counts_){
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+    Histogram(Histogram const &) = delete;
+    Histogram & operator=(Histogram const &) = delete;
+
+    static std::size_t bucket_of(std::uint64_t value){
+        if(value < 32)
+            return value;
+        auto m = msb(value);
+        auto top = value >> (m - 4);
+        return 32 + (m - 5) * 16 + (top - 16);
+    }
+    // largest value falling into the bucket
+    static std::uint64_t bucket_upper(std::size_t index){
+        if(index < 32)
+            return index;
+        auto m = (index - 32) / 16 + 5;
+        auto top = (index - 32) % 16 + 16;
+        return ((top + 1) << (m - 4)) - 1;
+    }
+    void record(std::uint64_t value){
+        bump(counts_[bucket_of(value)], 1);
+        bump(total_, 1);
+        bump(sum_, value);
+        if(value > max_.load(std::memory_order_relaxed))
+            max_.store(value, std::memory_order_relaxed);
+    }
+    // the counts of other are added (atomically, other may still be recording)
+    void merge(Histogram const & other){
+        for(std::size_t i = 0; i < num_of_buckets; ++i){
+            counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        total_.fetch_add(other.total_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        auto other_max = other.max_.load(std::memory_order_relaxed);
+        auto current = max_.load(std::memory_order_relaxed);
+        while(other_max > current && ! max_.compare_exchange_weak(current, other_max, std::memory_order_relaxed)){
+        }
+    }
+    std::uint64_t count() const{
+        return total_.load(std::memory_order_relaxed);
+    }
+    std::uint64_t sum() const{
+        return sum_.load(std::memory_order_relaxed);
+    }
+    std::uint64_t max() const{
+        return max_.load(std::memory_order_relaxed);
+    }
+    std::uint64_t bucket_count(std::size_t index) const{
+        return counts_[index].load(std::memory_order_relaxed);
+    }
+    // upper bound of the bucket holding the q-quantile (0 <= q <= 1)
+    std::uint64_t percentile(double q) const{
+        auto total = count();
+        if(total == 0)
+            return 0;
+        auto rank = static_cast<std::uint64_t>(q * total);
+        if(rank >= total)
+            rank = total - 1;
+        std::uint64_t seen = 0;
+        for(std::size_t i = 0; i < num_of_buckets; ++i){
+            seen += bucket_count(i);
+            if(seen > rank)
+                return std::min(bucket_upper(i), max());
+        }
+        return max();
+    }
+};
+
+#endif
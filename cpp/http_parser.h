@@ -0,0 +1,311 @@
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <boost/utility/string_ref.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline bool ascii_iequals(boost::string_ref a, boost::string_ref b){
+    if(a.size() != b.size())
+        return false;
+    for(std::size_t i = 0; i < a.size(); ++i){
+        auto x = a[i], y = b[i];
+        if(x >= 'A' && x <= 'Z')
+            x += 'a' - 'A';
+        if(y >= 'A' && y <= 'Z')
+            y += 'a' - 'A';
+        if(x != y)
+            return false;
+    }
+    return true;
+}
+
+static inline boost::string_ref trim_ows(boost::string_ref s){
+    while(! s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while(! s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// just past the first "\r\n\r\n" in [data, end), nullptr when there is none.
+// SSE2 looks at 16 positions per step; the lines inside are found with memchr, vectorized by libc
+static inline char const * find_headers_end(char const * data, char const * end){
+#ifdef __SSE2__
+    auto cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    for(; end - data >= 16 + 3; data += 16){
+        auto b0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data)), cr);
+        auto b1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data + 1)), lf);
+        auto b2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data + 2)), cr);
+        auto b3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data + 3)), lf);
+        auto mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), _mm_and_si128(b2, b3)));
+        if(mask != 0)
+            return data + __builtin_ctz(mask) + 4;
+    }
+#endif
+    for(; end - data >= 4; ++data){
+        data = static_cast<char const *>(std::memchr(data, '\r', end - data - 3));
+        if(! data)
+            return nullptr;
+        if(std::memcmp(data, "\r\n\r\n", 4) == 0)
+            return data + 4;
+    }
+    return nullptr;
+}
+
+/** Resumable HTTP/1.x parser, fed with the chunks as they are relayed.
+ *  State is kept between chunks and every byte is looked at once; bodies are skipped by
+ *  Content-Length or chunked framing so keep-alive streams with many messages are followed.
+ *  Handler gets
+ *      void on_start_line(boost::string_ref line);
+ *      void on_header(boost::string_ref name, boost::string_ref value);
+ *      bool on_headers_complete();     // false: the message has no body (response to HEAD)
+ *  Anything that does not look like HTTP turns the parser off for the rest of the stream. */
+template<typename Handler>
+class HttpParser{
+public:
+    enum class Type{request, response};
+    static const std::size_t max_line = 8192;
+private:
+    enum class State{start_line, header, body, chunk_size, chunk_data, chunk_data_end, trailer, until_close, ignore};
+    Handler & handler_;
+    Type type_;
+    State state_ = State::start_line;
+    std::string line_{};
+    unsigned long long remaining_ = 0;
+    bool chunked_ = false;
+    bool has_length_ = false;
+    bool no_body_ = false;
+    // CONNECT request or 101 response, the rest of the stream is not HTTP
+    bool tunnel_ = false;
+    int status_ = 0;
+
+    static bool is_token_char(char c){
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || (c != '\0' && std::strchr("!#$%&'*+-.^_`|~", c) != nullptr);
+    }
+    void message_complete(){
+        state_ = State::start_line;
+    }
+    bool parse_start_line(boost::string_ref line){
+        chunked_ = false;
+        has_length_ = false;
+        no_body_ = false;
+        tunnel_ = false;
+        remaining_ = 0;
+        if(type_ == Type::request){
+            auto sp = line.find(' ');
+            if(sp == 0 || sp == boost::string_ref::npos)
+                return false;
+            auto method = line.substr(0, sp);
+            if(! std::all_of(method.begin(), method.end(), is_token_char))
+                return false;
+            auto version = line.substr(line.rfind(' ') + 1);
+            if(version.substr(0, 5) != "HTTP/")
+                return false;
+            tunnel_ = method == "CONNECT";
+            return true;
+        }
+        if(line.size() < 12 || line.substr(0, 5) != "HTTP/" || line[8] != ' ')
+            return false;
+        status_ = 0;
+        for(std::size_t i = 9; i < 12; ++i){
+            if(line[i] < '0' || line[i] > '9')
+                return false;
+            status_ = status_ * 10 + (line[i] - '0');
+        }
+        no_body_ = status_ < 200 || status_ == 204 || status_ == 304;
+        tunnel_ = status_ == 101;
+        return true;
+    }
+    bool parse_header(boost::string_ref line){
+        // obsolete line folding, the continuation is not interesting
+        if(line.front() == ' ' || line.front() == '\t')
+            return true;
+        auto colon = line.find(':');
+        if(colon == 0 || colon == boost::string_ref::npos)
+            return false;
+        auto name = line.substr(0, colon);
+        auto value = trim_ows(line.substr(colon + 1));
+        if(ascii_iequals(name, "Content-Length")){
+            if(value.empty())
+                return false;
+            remaining_ = 0;
+            for(auto c : value){
+                if(c < '0' || c > '9')
+                    return false;
+                remaining_ = remaining_ * 10 + (c - '0');
+            }
+            has_length_ = true;
+        }else if(ascii_iequals(name, "Transfer-Encoding")){
+            auto last = value.substr(value.rfind(',') == boost::string_ref::npos ? 0 : value.rfind(',') + 1);
+            chunked_ = ascii_iequals(trim_ows(last), "chunked");
+        }
+        handler_.on_header(name, value);
+        return true;
+    }
+    void headers_complete(){
+        auto body = handler_.on_headers_complete();
+        if(tunnel_){
+            state_ = State::ignore;
+        }else if(! body || no_body_){
+            message_complete();
+        }else if(chunked_){
+            state_ = State::chunk_size;
+        }else if(has_length_){
+            if(remaining_ == 0)
+                message_complete();
+            else
+                state_ = State::body;
+        }else if(type_ == Type::request){
+            message_complete();
+        }else{
+            state_ = State::until_close;
+        }
+    }
+    bool parse_chunk_size(boost::string_ref line){
+        line = trim_ows(line.substr(0, line.find(';')));
+        if(line.empty() || line.size() > 15)
+            return false;
+        remaining_ = 0;
+        for(auto c : line){
+            int digit;
+            if(c >= '0' && c <= '9')
+                digit = c - '0';
+            else if(c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            remaining_ = remaining_ * 16 + digit;
+        }
+        state_ = remaining_ == 0 ? State::trailer : State::chunk_data;
+        return true;
+    }
+    bool on_line(boost::string_ref line){
+        switch(state_){
+        case State::start_line:
+            // stray CRLF between messages
+            if(line.empty())
+                return true;
+            if(! parse_start_line(line))
+                return false;
+            handler_.on_start_line(line);
+            state_ = State::header;
+            return true;
+        case State::header:
+            if(line.empty()){
+                headers_complete();
+                return true;
+            }
+            return parse_header(line);
+        case State::chunk_size:
+            return parse_chunk_size(line);
+        case State::chunk_data_end:
+            state_ = State::chunk_size;
+            return line.empty();
+        case State::trailer:
+            if(line.empty())
+                message_complete();
+            return true;
+        default:
+            return false;
+        }
+    }
+    // a complete start line and header block, [data, block_end) ends with the empty line:
+    // parsed where it lies instead of copied into line_
+    void parse_block(char const * & data, char const * block_end){
+        while(data != block_end && (state_ == State::start_line || state_ == State::header)){
+            auto nl = static_cast<char const *>(std::memchr(data, '\n', block_end - data));
+            if(static_cast<std::size_t>(nl - data) > max_line){
+                state_ = State::ignore;
+                return;
+            }
+            boost::string_ref line(data, nl - data);
+            data = nl + 1;
+            if(! line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            if(! on_line(line)){
+                state_ = State::ignore;
+                return;
+            }
+        }
+    }
+    void skip(char const * & data, char const * end, State next){
+        auto n = static_cast<std::size_t>(std::min<unsigned long long>(remaining_, end - data));
+        data += n;
+        remaining_ -= n;
+        if(remaining_ == 0){
+            if(next == State::start_line)
+                message_complete();
+            else
+                state_ = next;
+        }
+    }
+public:
+    HttpParser(Type type, Handler & handler):handler_(handler), type_(type){
+    }
+    HttpParser(HttpParser const &) = delete;
+    HttpParser & operator=(HttpParser const &) = delete;
+
+    // true once the stream turned out not to be (or no longer be) HTTP
+    bool ignoring() const{
+        return state_ == State::ignore;
+    }
+    // status code of the current response
+    int status() const{
+        return status_;
+    }
+    void feed(char const * data, std::size_t len){
+        auto end = data + len;
+        while(data != end){
+            switch(state_){
+            case State::ignore:
+            case State::until_close:
+                return;
+            case State::body:
+                skip(data, end, State::start_line);
+                break;
+            case State::chunk_data:
+                skip(data, end, State::chunk_data_end);
+                break;
+            default:{
+                if(state_ == State::start_line && line_.empty() && *data != '\r' && *data != '\n' && ! is_token_char(*data)){
+                    state_ = State::ignore;
+                    return;
+                }
+                if(line_.empty() && (state_ == State::start_line || state_ == State::header)){
+                    auto block_end = find_headers_end(data, end);
+                    if(block_end){
+                        parse_block(data, block_end);
+                        break;
+                    }
+                }
+                auto nl = static_cast<char const *>(std::memchr(data, '\n', end - data));
+                auto line_end = nl ? nl : end;
+                if(line_.size() + (line_end - data) > max_line){
+                    state_ = State::ignore;
+                    line_.clear();
+                    return;
+                }
+                line_.append(data, line_end);
+                data = line_end;
+                if(! nl)
+                    return;
+                ++data;
+                if(! line_.empty() && line_.back() == '\r')
+                    line_.pop_back();
+                if(! on_line(line_))
+                    state_ = State::ignore;
+                line_.clear();
+            }
+            }
+        }
+    }
+};
+
+#endif
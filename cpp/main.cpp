@@ -1,6 +1,7 @@
 #include <iostream>
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/coroutine.hpp>
 #include <boost/thread.hpp>
 #include <mutex>
 #if PORT_FORWARD_ENABLE_STACK_TRACE
@@ -8,10 +9,34 @@
 #endif
 #include <algorithm>
 #include <iterator>
-#include <boost/regex.hpp>
 #include <sstream>
 #include <unordered_map>
 #include <chrono>
+#include <array>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <cstring>
+#include <csignal>
+#include "buffer_pool.h"
+#include "http_parser.h"
+#include "event_log.h"
+#include "resolver_cache.h"
+#include "upstream_pool.h"
+#include "upstream_group.h"
+#include "metrics.h"
+#include "socks5.h"
+#include "timer_wheel.h"
+#include "uring_relay.h"
+#include "udp_relay.h"
+#include "capture.h"
+#include "handover.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 template<typename T>
 struct CoroutineWrapper{
@@ -31,244 +56,760 @@ struct CoroutineWrapper{
     }
 };
 
+// location path of a 302 -> the request that got redirected.
+// entries are spread over shards by key hash, each shard keeps two generations which rotate
+// every `duration` or as soon as the current one is full, so memory stays under the caps
 class RedirectTrace{
-    std::vector<std::unordered_map<std::string, std::string>> dicts{};
-    std::chrono::time_point<std::chrono::system_clock> next_rotate_and_clear_point{std::chrono::system_clock::now()};
+    using value_type = std::shared_ptr<const std::string>;
+    struct Generation{
+        std::unordered_map<std::string, value_type> map{};
+        std::size_t bytes = 0;
+    };
+    struct Shard{
+        std::mutex mutex{};
+        // [0] is the older generation
+        Generation generations[2]{};
+        std::chrono::steady_clock::time_point next_rotate_point{};
+    };
+    static const std::size_t num_of_shards = 16;
+    std::array<Shard, num_of_shards> shards{};
     std::chrono::seconds duration{60};
-    std::mutex mutex;
+    std::size_t max_entries_per_generation;
+    std::size_t max_bytes_per_generation;
 
-    void rotate_and_clear(){
-        if(std::chrono::system_clock::now() > next_rotate_and_clear_point){
-            dicts[0].clear();
-            std::rotate(std::begin(dicts), std::begin(dicts) + 1, std::end(dicts));
-            next_rotate_and_clear_point += duration;
+    Shard & shard_of(std::string const & key){
+        return shards[std::hash<std::string>()(key) % num_of_shards];
+    }
+    // called with the shard locked, the old entries are handed back in expired to be freed after
+    // unlocking; after a quiet spell longer than duration both generations are out of date
+    void rotate_if_needed(Shard & shard, Generation (&expired)[2]){
+        auto & current = shard.generations[1];
+        auto now = std::chrono::steady_clock::now();
+        if(now >= shard.next_rotate_point || current.map.size() >= max_entries_per_generation || current.bytes >= max_bytes_per_generation){
+            std::swap(expired[0], shard.generations[0]);
+            if(now >= shard.next_rotate_point + duration){
+                std::swap(expired[1], current);
+            }else{
+                std::swap(shard.generations[0], current);
+            }
+            shard.next_rotate_point = now + duration;
         }
     }
 public:
-    RedirectTrace(){
-        dicts.resize(2);
-    }
-    void set(std::string const & key, std::string const & value){
-        std::lock_guard<std::mutex> lock(mutex);
-        dicts[1][key] = value;
-        rotate_and_clear();
+    RedirectTrace(std::size_t max_entries = 16384, std::size_t max_bytes = 16 * 1024 * 1024)
+        : max_entries_per_generation(std::max<std::size_t>(max_entries / num_of_shards / 2, 1)),
+          max_bytes_per_generation(std::max<std::size_t>(max_bytes / num_of_shards / 2, 1)){
+        auto now = std::chrono::steady_clock::now();
+        for(auto & shard : shards){
+            shard.next_rotate_point = now + duration;
+        }
     }
-    std::string get(std::string const & key){
-        std::lock_guard<std::mutex> lock(mutex);
-        auto iter = dicts[1].find(key);
-        if(iter != dicts[1].end()){
-            return dicts[1][key];
+    void set(std::string const & key, std::string value){
+        auto bytes = key.size() + value.size();
+        auto shared_value = std::make_shared<const std::string>(std::move(value));
+        auto & shard = shard_of(key);
+        Generation expired[2];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            rotate_if_needed(shard, expired);
+            auto & current = shard.generations[1];
+            auto result = current.map.emplace(key, shared_value);
+            if(result.second){
+                current.bytes += bytes;
+            }else{
+                current.bytes += shared_value->size();
+                current.bytes -= std::min(current.bytes, result.first->second->size());
+                result.first->second = std::move(shared_value);
+            }
         }
-        iter = dicts[0].find(key);
-        if(iter != dicts[0].end()){
-            return dicts[0][key];
+    }
+    // null when the key is unknown or expired
+    value_type get(std::string const & key){
+        auto & shard = shard_of(key);
+        Generation expired[2];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        rotate_if_needed(shard, expired);
+        for(auto i = 2; i-- > 0;){
+            auto & map = shard.generations[i].map;
+            auto iter = map.find(key);
+            if(iter != map.end()){
+                return iter->second;
+            }
         }
-        rotate_and_clear();
-        return "";
+        return value_type{};
     }
 };
 
 
-std::string search(boost::regex const & pattern, boost::asio::streambuf const & buf){
-    typedef typename boost::asio::streambuf::const_buffers_type const_buffers_type;
-    typedef boost::asio::buffers_iterator<const_buffers_type> iterator;
-    const_buffers_type buffers = buf.data();
-    iterator begin = iterator::begin(buffers);
-    iterator end = iterator::end(buffers);
-    boost::match_results<iterator> match_results;
-    boost::regex_search(begin, end, match_results, pattern);
-    if(! match_results[0].matched)
-        return "";
-    else
-        return match_results[0].str();
-}
+/** Filter policy of Pipe following HTTP/1.x in both directions: attachment downloads go to the
+ *  EventLog, 302 redirects are traced back to the request that led to them. */
+class HttpFilter{
+    // a request waiting for its response
+    struct Request{
+        std::string text{};
+        std::string path{};
+        bool get = false;
+        bool head = false;
+    };
+    static const std::size_t max_request_text = 4096 * 3;
+    static const std::size_t max_pending = 64;
 
-std::string encode(std::string const & src){
-    std::ostringstream t(std::ios::out | std::ios::binary);
-    t << "'";
-    std::ostream_iterator<char, char> oi(t);
-    boost::regex_replace(oi, src.begin(), src.end(), boost::regex("'"), R"a('"'"')a", boost::match_default | boost::format_all);
-    t << "'";
-    return t.str();
-}
+    struct RequestEvents{
+        HttpFilter & filter;
+        void on_start_line(boost::string_ref line){
+            auto & request = filter.request;
+            request = Request{};
+            auto method = line.substr(0, line.find(' '));
+            auto target = line.substr(method.size() + 1);
+            target = target.substr(0, target.find(' '));
+            request.head = method == "HEAD";
+            request.get = method == "GET" && ! target.empty() && target.front() == '/';
+            if(request.get){
+                request.path = target.to_string();
+                request.text.append(line.begin(), line.end());
+                request.text += "\r\n";
+            }
+        }
+        void on_header(boost::string_ref name, boost::string_ref value){
+            auto & request = filter.request;
+            if(! request.get)
+                return;
+            if(request.text.size() + name.size() + value.size() + 4 > max_request_text){
+                request = Request{};
+                return;
+            }
+            request.text.append(name.begin(), name.end());
+            request.text += ": ";
+            request.text.append(value.begin(), value.end());
+            request.text += "\r\n";
+        }
+        bool on_headers_complete(){
+            auto & pending = filter.pending;
+            if(filter.request.get)
+                filter.request.text += "\r\n";
+            std::lock_guard<std::mutex> lock(filter.pending_mutex);
+            // the other side is not answering, keep the memory bounded
+            if(pending.size() >= max_pending)
+                pending.pop_front();
+            pending.push_back(std::move(filter.request));
+            filter.request = Request{};
+            return true;
+        }
+    };
+    struct ResponseEvents{
+        HttpFilter & filter;
+        void on_start_line(boost::string_ref){
+            filter.location_path.clear();
+            filter.attachment = false;
+        }
+        void on_header(boost::string_ref name, boost::string_ref value){
+            if(filter.response_parser.status() == 302 && ascii_iequals(name, "Location")){
+                if(value.substr(0, 7) != "http://")
+                    return;
+                auto path = value.substr(7);
+                auto slash = path.find('/');
+                if(slash == 0 || slash == boost::string_ref::npos)
+                    return;
+                path = path.substr(slash);
+                filter.location_path = path.substr(0, path.find(' ')).to_string();
+            }else if(ascii_iequals(name, "Content-Disposition")){
+                if(value.substr(0, 11) != "attachment;")
+                    return;
+                value.remove_prefix(11);
+                while(! value.empty() && value.front() == ' ')
+                    value.remove_prefix(1);
+                filter.attachment = value.substr(0, 9) == "filename=";
+            }
+        }
+        bool on_headers_complete(){
+            auto & pending = filter.pending;
+            // interim response, the final one follows
+            if(filter.response_parser.status() < 200)
+                return true;
+            Request request{};
+            {
+                std::lock_guard<std::mutex> lock(filter.pending_mutex);
+                if(! pending.empty()){
+                    request = std::move(pending.front());
+                    pending.pop_front();
+                }
+            }
+            if(! filter.location_path.empty()){
+                if(request.get)
+                    redirect_trace.set(filter.location_path, std::move(request.text));
+            }else if(filter.attachment && request.get){
+                // formatting and writing happen on the EventLog thread
+                DownloadEvent event;
+                event.time = std::chrono::system_clock::now();
+                auto request_tmp = redirect_trace.get(request.path);
+                if(request_tmp){
+                    event.request = *request_tmp;
+                } else{
+                    event.request = std::move(request.text);
+                }
+                EventLog::instance().push(std::move(event));
+            }
+            return ! request.head;
+        }
+    };
 
-std::string get_request_path(std::string const &in){
-    boost::regex pattern("^GET +(/[^ ]+)", boost::regex::perl);
-    boost::match_results<std::string::const_iterator> match_results;
-    boost::regex_search(in.begin(), in.end(), match_results, pattern);
-    auto url = match_results[1].str();
-    return url;
-}
+    // the only state shared by the two directions
+    std::mutex pending_mutex{};
+    std::deque<Request> pending{};
+    Request request{};
+    std::string location_path{};
+    bool attachment = false;
+    static RedirectTrace redirect_trace;
+    RequestEvents request_events{*this};
+    ResponseEvents response_events{*this};
+    HttpParser<RequestEvents> request_parser{HttpParser<RequestEvents>::Type::request, request_events};
+    HttpParser<ResponseEvents> response_parser{HttpParser<ResponseEvents>::Type::response, response_events};
+public:
+    static const bool enabled = true;
+    HttpFilter() = default;
+    HttpFilter(HttpFilter const &) = delete;
+    HttpFilter & operator=(HttpFilter const &) = delete;
 
-std::string get_302_location_path(boost::asio::streambuf const & buf){
-    boost::regex pattern{"HTTP/\\d\\.\\d +?302.+\r\nLocation: +http://[^/]+([^ \r\n]+)", boost::regex::perl};
-    typedef typename boost::asio::streambuf::const_buffers_type const_buffers_type;
-    typedef boost::asio::buffers_iterator<const_buffers_type> iterator;
-    const_buffers_type buffers = buf.data();
-    iterator begin = iterator::begin(buffers);
-    iterator end = iterator::end(buffers);
-    boost::match_results<iterator> match_results;
-    boost::regex_search(begin, end, match_results, pattern);
-    if(match_results[0].matched){
-        return match_results[1].str();
-    }
-    return "";
-}
+    void add_request_content(boost::asio::const_buffer buf){
+        request_parser.feed(boost::asio::buffer_cast<char const *>(buf), boost::asio::buffer_size(buf));
+    }
+    void add_response_content(boost::asio::const_buffer buf){
+        response_parser.feed(boost::asio::buffer_cast<char const *>(buf), boost::asio::buffer_size(buf));
+    }
+    // false once that direction turned out not to be HTTP, nothing more to find in it then
+    bool active(bool request_part) const{
+        return ! (request_part ? request_parser.ignoring() : response_parser.ignoring());
+    }
+};
+RedirectTrace HttpFilter::redirect_trace{};
 
+// filter policy of a plain relay: nothing is looked at and splice(2) is used when available
+struct NullFilter{
+    static const bool enabled = false;
+    void add_request_content(boost::asio::const_buffer){
+    }
+    void add_response_content(boost::asio::const_buffer){
+    }
+    bool active(bool) const{
+        return false;
+    }
+};
 
-std::string convert_request_to_curl_cmd(std::string const & in){
-    std::ostringstream out;
-    boost::regex pattern("^GET +(/[^ ]+)", boost::regex::perl);
-    boost::match_results<std::string::const_iterator> match_results;
-    boost::regex_search(in.cbegin(), in.cend(), match_results, pattern);
-    auto url = match_results[1].str();
-    pattern = "Host: +([^ \r\n]+)";
-    boost::regex_search(in.cbegin(), in.cend(), match_results, pattern);
-    auto host = match_results[1].str();
-    url = "http://" + host + url;
-    out << "curl " << encode(url) << " ";
-    pattern = boost::regex("^([^:\r\n]+): +(?:[^\r\n]+)$", boost::regex::perl);
-    auto start = in.cbegin();
-    auto end = in.cend();
-    while(boost::regex_search(start, end, match_results, pattern)){
-        if(match_results[0].matched){
-            if(match_results[1].str() != "Host")
-                out << "-H " << encode(match_results.str()) << " ";
-            start += match_results.position() + match_results.length();
-        }
-    }
-    out << "--compressed ";
-    return out.str();
-}
+#ifdef __linux__
+// kernel pipe used as the intermediate buffer of splice(2)
+class SplicePipe{
+    static const std::size_t chunk = 65536;
+    // bytes in the pipe not written to the destination yet
+    std::size_t in_pipe_ = 0;
+    bool moved_ = false;
 
-class RequestFilter{
-    boost::asio::streambuf request_buf{};
-    std::ostream request_os{&request_buf};
-    boost::asio::streambuf response_buf{};
-    std::ostream response_os{&response_buf};
-    static const boost::regex request_pattern;
-    static const boost::regex response_pattern;
-    std::string request{};
-    static RedirectTrace redirect_trace;
+    // splice(2) into a socket the peer has closed raises SIGPIPE, there is no MSG_NOSIGNAL for it.
+    // Ignored once for the process, the error is handled as EPIPE
+    static void ignore_sigpipe(){
+        static const bool ignored = ::signal(SIGPIPE, SIG_IGN) != SIG_ERR;
+        (void)ignored;
+    }
 public:
-    void add_request_content(std::vector<char> buf, std::size_t len){
-        if(request_buf.size() > 4096 * 3)
-            return;
-        request_os.write(buf.data(), len);
-        auto result = search(request_pattern, request_buf);
-        if(result.length() > 0){
-//            std::cout << result << std::endl;
-//            auto path = get_request_path(result);
-//            std::cout << path << std::endl;
-            request = result;
-            request_buf.consume(request_buf.size());
-        }
-//        if(request_buf.size() > 4096 * 3){
-//            request_buf.consume(request_buf.size() - 4096 * 2);
-//        }
-    }
-    void add_response_content(std::vector<char> buf, std::size_t len){
-        if (response_buf.size()  > 4096 * 3)
-            return;
-        response_os.write(buf.data(), len);
-        auto location_path = get_302_location_path(response_buf);
-        if(location_path.length() > 0){
-            if(request.length() > 0){
-                redirect_trace.set(location_path, std::move(request));
-                request = "";
-            }
-//            std::cout << location_path << std::endl;
-            request_buf.consume(request_buf.size());
-            response_buf.consume(response_buf.size());
-            return;
+    enum Step{progress, wait_read, wait_write, unsupported, failed};
+    int read_fd = -1;
+    int write_fd = -1;
+    SplicePipe(){
+        ignore_sigpipe();
+        int fds[2];
+        if(::pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0){
+            read_fd = fds[0];
+            write_fd = fds[1];
         }
-        auto result = search(response_pattern, response_buf);
-        if(result.length() > 0){
-            if(request.length() > 0){
-                auto path = get_request_path(request);
-                auto const & request_tmp = redirect_trace.get(path);
-                if(request_tmp.length() > 0){
-                    std::cout << convert_request_to_curl_cmd(request_tmp) << std::endl;
-                } else{
-                    std::cout << convert_request_to_curl_cmd(request) << std::endl;
+    }
+    SplicePipe(SplicePipe const &) = delete;
+    SplicePipe & operator=(SplicePipe const &) = delete;
+    ~SplicePipe(){
+        if(read_fd >= 0)
+            ::close(read_fd);
+        if(write_fd >= 0)
+            ::close(write_fd);
+    }
+    bool valid() const{
+        return read_fd >= 0;
+    }
+    // moves one chunk from src to dst inside the kernel without blocking, bytes is what left src.
+    // wait_read/wait_write: wait for readiness and step again. unsupported: splice(2) can not be
+    // used for this pair and nothing moved yet. failed: ec is set, eof included.
+    Step step(int src, int dst, std::size_t & bytes, boost::system::error_code & ec){
+        bytes = 0;
+        while(true){
+            if(in_pipe_ > 0){
+                auto m = ::splice(read_fd, nullptr, dst, nullptr, in_pipe_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if(m < 0){
+                    if(errno == EINTR)
+                        continue;
+                    if(errno == EAGAIN)
+                        return wait_write;
+                    ec = boost::system::error_code(errno, boost::system::system_category());
+                    return failed;
                 }
-		std::cout << std::endl;
-                request = "";
+                in_pipe_ -= m;
+                continue;
             }
-            response_buf.consume(response_buf.size());
-            request_buf.consume(request_buf.size());
+            if(bytes > 0)
+                return progress;
+            auto n = ::splice(src, nullptr, write_fd, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n == 0){
+                ec = boost::asio::error::eof;
+                return failed;
+            }
+            if(n < 0){
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN)
+                    return wait_read;
+                if(! moved_ && (errno == EINVAL || errno == ENOSYS))
+                    return unsupported;
+                ec = boost::system::error_code(errno, boost::system::system_category());
+                return failed;
+            }
+            moved_ = true;
+            bytes = n;
+            in_pipe_ = n;
         }
-//        if(response_buf.size() > 4096 * 3){
-//            response_buf.consume(response_buf.size() - 4096 * 2);
-//        }
     }
 };
-const boost::regex RequestFilter::request_pattern{"GET /.*HTTP/\\d\\.\\d\r\n.*\r\n\r\n", boost::regex::perl};
-const boost::regex RequestFilter::response_pattern{"Content-Disposition: +attachment; *filename=", boost::regex::perl};
-RedirectTrace RequestFilter::redirect_trace{};
+#endif
 
-class Pipe : public std::enable_shared_from_this<Pipe>{
+// Filter: the policy the relayed bytes go through, HttpFilter or NullFilter
+template<typename Filter>
+class Pipe : public std::enable_shared_from_this<Pipe<Filter>>{
 public:
     using socket = boost::asio::ip::tcp::socket;
-    Pipe(socket && socket0, socket && socket1):socket_0(std::move(socket0)), socket_1(std::move(socket1)), strand_(socket_0.get_io_service()){
+    // buffer memory a direction may hold, read ahead of the writer
+    static const std::size_t window = 1024 * 1024;
+    // chunks handed to one writev(2)
+    static const std::size_t max_gather = 16;
+    Pipe(socket && socket0, socket && socket1)
+        : socket_0(std::move(socket0)), socket_1(std::move(socket1)), filter_(Filter::enabled ? new Filter : nullptr),
+          wheel_(boost::asio::use_service<TimerWheel>(socket_0.get_io_service())),
+          relay_0(socket_0, socket_1, true), relay_1(socket_1, socket_0, false){
+        ThreadMetrics::bump(Metrics::local().pipes_opened);
     }
-    void start();
+    ~Pipe(){
+        wheel_.cancel(idle_timer_);
+        auto & metrics = Metrics::local();
+        ThreadMetrics::bump(metrics.pipes_closed);
+        if(capture_id_ != 0){
+            if(auto capture = capture::Capture::local())
+                capture->close(capture_id_);
+        }
+        metrics.pipe_lifetime.record(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - opened_).count());
+        if(on_close)
+            on_close();
+    }
+    // initial: bytes already read from socket_0 (pipelined behind a handshake), relayed first
+    void start(RelayBuffer initial = RelayBuffer(), std::size_t initial_length = 0);
+    // run once both directions have finished
+    std::function<void()> on_close{};
+    // set before start(): no byte in either direction for this long closes the pipe, 0 never does
+    std::chrono::milliseconds idle_timeout{0};
+    // the two directions run independently; the sockets are closed when the last one finishes
     socket socket_0, socket_1;
-    boost::asio::strand strand_;
-    RequestFilter filter{};
+    // dropped once neither direction feeds it any more, and never there for NullFilter
+    std::unique_ptr<Filter> filter_;
+    // set before start(): relay through the io_uring engine of the io_service when it has one
+    bool io_uring = false;
+private:
+    // one direction. on the copy path the reader queues chunks while the writer drains them,
+    // so the next read overlaps the current write
+    struct Relay{
+        socket & src;
+        socket & dst;
+        bool request_part;
+        // the reader and the writer of the direction run here, the other direction has its own
+        boost::asio::io_service::strand strand;
+        // woken with cancel(); the condition is checked before waiting, on the strand
+        boost::asio::deadline_timer reader_wakeup;
+        boost::asio::deadline_timer writer_wakeup;
+        std::deque<std::pair<RelayBuffer, std::size_t>> chunks{};
+        // capacity of the queued buffers
+        std::size_t queued = 0;
+        bool eof = false;
+        bool failed = false;
+        // size of the next read
+        std::size_t size = RelayBuffer::min_capacity;
+        // the chunks of the write in flight, the unused ones stay empty
+        std::array<boost::asio::const_buffer, max_gather> gather{};
+        std::size_t gathered = 0;
+        // relayed before anything else
+        RelayBuffer initial{};
+        std::size_t initial_length = 0;
+        // this direction still feeds the filter
+        bool inspecting = Filter::enabled;
+#ifdef __linux__
+        std::unique_ptr<SplicePipe> splice{};
+#endif
+        Relay(socket & src, socket & dst, bool request_part)
+            : src(src), dst(dst), request_part(request_part), strand(src.get_io_service()), reader_wakeup(src.get_io_service()), writer_wakeup(src.get_io_service()){
+        }
+        ~Relay(){
+            MemoryBudget::instance().charge(-static_cast<long long>(queued));
+        }
+        ThreadMetrics::Direction direction() const{
+            return request_part ? ThreadMetrics::client_to_upstream : ThreadMetrics::upstream_to_client;
+        }
+    };
+    // the loops of a direction are stackless coroutines (boost::asio::coroutine): their state
+    // lives in the Relay, so a connection holds no coroutine stack while relaying
+    class Reader;
+    class Writer;
+    std::chrono::steady_clock::time_point opened_ = std::chrono::steady_clock::now();
+    // steady_clock ticks, touched by both directions
+    std::atomic<std::chrono::steady_clock::rep> last_activity_{opened_.time_since_epoch().count()};
+    // directions still feeding the filter, the last one to stop frees it
+    std::atomic<int> inspecting_{Filter::enabled ? 2 : 0};
+    TimerWheel & wheel_;
+    TimerWheel::Handle idle_timer_{};
+    // --capture connection id, 0 when not captured
+    std::uint64_t capture_id_ = 0;
+    Relay relay_0, relay_1;
+
+    static void finish(socket & socket_src, socket & socket_dst, boost::system::error_code const & error){
+        boost::system::error_code ec;
+        if(error == boost::asio::error::eof){
+            // half-close, pass the FIN on and let the other direction finish
+            socket_dst.shutdown(socket::shutdown_send, ec);
+        }else{
+            // shutdown (not close) so the other direction wakes up and ends
+            socket_src.shutdown(socket::shutdown_both, ec);
+            socket_dst.shutdown(socket::shutdown_both, ec);
+        }
+    }
+    void watch_idle(std::chrono::milliseconds after);
+    void touch(){
+        last_activity_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    // false when the reader has to wait: window full, or over the memory budget with a chunk queued
+    bool may_read(Relay const & relay) const{
+        return relay.queued < window && (relay.queued == 0 || ! MemoryBudget::instance().exceeded());
+    }
+    // reads what is ready and queues it for the writer; false with ec clear on would_block
+    bool read_ready(Relay & relay, boost::system::error_code & ec);
+    void read_failed(Relay & relay, boost::system::error_code const & ec);
+    void gather(Relay & relay);
+    void written(Relay & relay);
+    void inspect(Relay & relay, boost::asio::const_buffer data){
+        if(! Filter::enabled || ! relay.inspecting)
+            return;
+        if(relay.request_part){
+            filter_->add_request_content(data);
+        }else{
+            filter_->add_response_content(data);
+        }
+        if(! filter_->active(relay.request_part)){
+            relay.inspecting = false;
+            if(inspecting_.fetch_sub(1) == 1)
+                filter_.reset();
+        }
+    }
+    // data null: the bytes were spliced, their count is recorded alone
+    void record(Relay const & relay, char const * data, std::size_t length){
+        if(capture_id_ == 0)
+            return;
+        if(auto capture = capture::Capture::local())
+            capture->data(capture_id_, relay.direction(), data, length);
+    }
+#if PORT_FORWARD_HAS_IO_URING
+    template<typename Handler>
+    void relay_uring(Relay & relay, Handler handler);
+#endif
 };
-void Pipe::start(){
-//    std::cerr << "start\n";
-    auto self = shared_from_this();
-    auto read_and_write = [self, this](boost::asio::yield_context yield, socket & socket_src, socket & socket_dst, bool request_part){
-//        const boost::regex pattern("Content-Disposition: attachment;[^\r]+(?=\r\n)", boost::regex::perl);
-//        const boost::regex pattern("GET /.*HTTP/\\d\\.\\d\r\n.*\r\n\r\n", boost::regex::perl);
-        std::vector<char> buf;
-        buf.resize(4096);
-        while(true){
-            try{
-                auto length = socket_src.async_read_some(boost::asio::buffer(buf), yield);
-                if(request_part){
-                    filter.add_request_content(buf, length);
-                }else{
-                    filter.add_response_content(buf, length);
+
+template<typename Filter>
+class Pipe<Filter>::Reader : boost::asio::coroutine{
+    std::shared_ptr<Pipe> pipe_;
+    Relay * relay_;
+public:
+    Reader(std::shared_ptr<Pipe> pipe, Relay & relay):pipe_(std::move(pipe)), relay_(&relay){
+    }
+    void operator()(boost::system::error_code ec = boost::system::error_code(), std::size_t = 0);
+};
+
+template<typename Filter>
+class Pipe<Filter>::Writer : boost::asio::coroutine{
+    std::shared_ptr<Pipe> pipe_;
+    Relay * relay_;
+public:
+    Writer(std::shared_ptr<Pipe> pipe, Relay & relay):pipe_(std::move(pipe)), relay_(&relay){
+    }
+    void operator()(boost::system::error_code ec = boost::system::error_code(), std::size_t = 0);
+};
+
+template<typename Filter>
+void Pipe<Filter>::Reader::operator()(boost::system::error_code ec, std::size_t){
+    auto & pipe = *pipe_;
+    auto & relay = *relay_;
+#ifdef __linux__
+    SplicePipe::Step step;
+    std::size_t bytes;
+#endif
+    BOOST_ASIO_CORO_REENTER(this){
+        if(relay.initial_length > 0){
+            BOOST_ASIO_CORO_YIELD boost::asio::async_write(relay.dst, boost::asio::buffer(relay.initial.data(), relay.initial_length), relay.strand.wrap(*this));
+            relay.initial = RelayBuffer();
+            if(ec){
+                relay.failed = true;
+                finish(relay.src, relay.dst, ec);
+                return;
+            }
+        }
+#if PORT_FORWARD_HAS_IO_URING
+        if(pipe.io_uring && boost::asio::use_service<UringRelay>(relay.src.get_io_service()).available()){
+            BOOST_ASIO_CORO_YIELD pipe.relay_uring(relay, relay.strand.wrap(*this));
+            finish(relay.src, relay.dst, ec);
+            return;
+        }
+#endif
+#ifdef __linux__
+        if(! Filter::enabled){
+            relay.splice.reset(new SplicePipe);
+            while(relay.splice->valid()){
+                step = relay.splice->step(relay.src.native_handle(), relay.dst.native_handle(), bytes, ec);
+                if(bytes > 0){
+                    pipe.touch();
+                    Metrics::local().add_bytes(relay.direction(), bytes);
+                    pipe.record(relay, nullptr, bytes);
                 }
-                boost::asio::async_write(socket_dst, boost::asio::buffer(buf.data(), length), yield);
-            }catch(const boost::system::system_error &e){
-//                std::cerr << "normal exit:" << e.what() << "\n";
-                try{
-                    socket_src.close();
-                }catch(const boost::system::system_error & e){
-//                    std::cerr << "failed to close src:" << e.what() << "\n";
+                if(step == SplicePipe::unsupported)
+                    break;
+                // locals do not survive a yield, only ec is looked at after one
+                if(step == SplicePipe::wait_read){
+                    BOOST_ASIO_CORO_YIELD relay.src.async_read_some(boost::asio::null_buffers(), relay.strand.wrap(*this));
+                }else if(step == SplicePipe::wait_write){
+                    BOOST_ASIO_CORO_YIELD relay.dst.async_write_some(boost::asio::null_buffers(), relay.strand.wrap(*this));
                 }
-                try{
-                    socket_dst.close();
-                }catch(const boost::system::system_error& e){
-//                    std::cerr << "failed to close dst:" << e.what() << "\n";
+                if(ec){
+                    finish(relay.src, relay.dst, ec);
+                    return;
                 }
-
-                break;
             }
+            relay.splice.reset();
+        }
+#endif
+        Writer(pipe_, relay)();
+        while(true){
+            while(! pipe.may_read(relay) && ! relay.failed){
+                relay.reader_wakeup.expires_at(boost::posix_time::pos_infin);
+                BOOST_ASIO_CORO_YIELD relay.reader_wakeup.async_wait(relay.strand.wrap(*this));
+            }
+            if(relay.failed)
+                return;
+            // wait for readiness first, so an idle connection holds no buffer
+            BOOST_ASIO_CORO_YIELD relay.src.async_read_some(boost::asio::null_buffers(), relay.strand.wrap(*this));
+            if(! ec)
+                pipe.read_ready(relay, ec);
+            if(ec){
+                pipe.read_failed(relay, ec);
+                return;
+            }
+        }
+    }
+}
 
+template<typename Filter>
+void Pipe<Filter>::Writer::operator()(boost::system::error_code ec, std::size_t){
+    auto & pipe = *pipe_;
+    auto & relay = *relay_;
+    BOOST_ASIO_CORO_REENTER(this){
+        while(true){
+            while(relay.chunks.empty() && ! relay.eof && ! relay.failed){
+                relay.writer_wakeup.expires_at(boost::posix_time::pos_infin);
+                BOOST_ASIO_CORO_YIELD relay.writer_wakeup.async_wait(relay.strand.wrap(*this));
+            }
+            if(relay.failed)
+                return;
+            if(relay.chunks.empty()){
+                finish(relay.src, relay.dst, boost::asio::error::eof);
+                return;
+            }
+            pipe.gather(relay);
+            BOOST_ASIO_CORO_YIELD boost::asio::async_write(relay.dst, relay.gather, relay.strand.wrap(*this));
+            if(ec){
+                relay.failed = true;
+                relay.reader_wakeup.cancel();
+                finish(relay.src, relay.dst, ec);
+                return;
+            }
+            pipe.written(relay);
         }
+    }
+}
+
+#if PORT_FORWARD_HAS_IO_URING
+// the whole direction runs in the engine, only the bytes received come back here
+template<typename Filter>
+template<typename Handler>
+void Pipe<Filter>::relay_uring(Relay & relay, Handler handler){
+    auto observer = [this, &relay](boost::asio::const_buffer data){
+        touch();
+        inspect(relay, data);
+        record(relay, boost::asio::buffer_cast<char const *>(data), boost::asio::buffer_size(data));
     };
-    boost::asio::spawn(strand_, [this, read_and_write](boost::asio::yield_context yield){
-        read_and_write(yield, socket_0, socket_1, true);
-    });
-    boost::asio::spawn(strand_, [this, read_and_write](boost::asio::yield_context yield){
-        read_and_write(yield, socket_1, socket_0, false);
+    auto & engine = boost::asio::use_service<UringRelay>(relay.src.get_io_service());
+    engine.relay(relay.src.native_handle(), relay.dst.native_handle(), relay.direction(), observer, handler);
+}
+#endif
+
+template<typename Filter>
+void Pipe<Filter>::start(RelayBuffer initial, std::size_t initial_length){
+//    std::cerr << "start\n";
+    auto self = this->shared_from_this();
+    if(idle_timeout.count() > 0)
+        watch_idle(idle_timeout);
+    if(auto capture = capture::Capture::local()){
+        boost::system::error_code ec;
+        capture_id_ = capture->open(socket_0.remote_endpoint(ec), socket_1.remote_endpoint(ec));
+    }
+    if(initial_length > 0){
+        Metrics::local().add_bytes(ThreadMetrics::client_to_upstream, initial_length);
+        inspect(relay_0, boost::asio::buffer(initial.data(), initial_length));
+        record(relay_0, initial.data(), initial_length);
+        relay_0.initial = std::move(initial);
+        relay_0.initial_length = initial_length;
+    }
+    // set once here, the directions share the sockets
+    boost::system::error_code ec;
+    socket_0.non_blocking(true, ec);
+    socket_1.non_blocking(true, ec);
+    relay_0.strand.post(Reader(self, relay_0));
+    relay_1.strand.post(Reader(self, relay_1));
+}
+// checks the last activity when the timeout comes up instead of moving the timer on every read
+template<typename Filter>
+void Pipe<Filter>::watch_idle(std::chrono::milliseconds after){
+    std::weak_ptr<Pipe> weak = this->shared_from_this();
+    idle_timer_ = wheel_.schedule(after, [weak](){
+        auto self = weak.lock();
+        if(! self)
+            return;
+        auto idle = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(self->last_activity_.load(std::memory_order_relaxed));
+        if(idle < self->idle_timeout){
+            self->watch_idle(std::chrono::duration_cast<std::chrono::milliseconds>(self->idle_timeout - idle));
+            return;
+        }
+        Metrics::local().error("idle", boost::asio::error::timed_out);
+        finish(self->socket_0, self->socket_1, boost::asio::error::timed_out);
     });
 }
+template<typename Filter>
+bool Pipe<Filter>::read_ready(Relay & relay, boost::system::error_code & ec){
+    auto & budget = MemoryBudget::instance();
+    // over the global budget a direction keeps at most one buffer queued, and a small one
+    auto buf = RelayBuffer::allocate(budget.exceeded() ? RelayBuffer::min_capacity : relay.size);
+    auto length = relay.src.read_some(buf.buffer(), ec);
+    if(ec == boost::asio::error::would_block){
+        ec = boost::system::error_code();
+        return false;
+    }
+    if(ec)
+        return false;
+    touch();
+    // a full buffer means a bulk transfer, take the next size class;
+    // a mostly empty one means interactive traffic, go back down
+    if(length == buf.capacity() && relay.size < RelayBuffer::max_capacity){
+        relay.size *= 4;
+    }else if(length < buf.capacity() / 8 && relay.size > RelayBuffer::min_capacity){
+        relay.size /= 4;
+    }
+    Metrics::local().add_bytes(relay.direction(), length);
+    inspect(relay, boost::asio::buffer(buf.data(), length));
+    record(relay, buf.data(), length);
+    relay.queued += buf.capacity();
+    budget.charge(buf.capacity());
+    relay.chunks.emplace_back(std::move(buf), length);
+    relay.writer_wakeup.cancel();
+    return true;
+}
+template<typename Filter>
+void Pipe<Filter>::read_failed(Relay & relay, boost::system::error_code const & ec){
+//    std::cerr << "normal exit:" << ec.message() << "\n";
+    if(ec == boost::asio::error::eof){
+        // the writer drains the queue, then passes the FIN on
+        relay.eof = true;
+    }else{
+        relay.failed = true;
+        finish(relay.src, relay.dst, ec);
+    }
+    relay.writer_wakeup.cancel();
+}
+// small chunks queued during the last write go out together
+template<typename Filter>
+void Pipe<Filter>::gather(Relay & relay){
+    relay.gathered = std::min(relay.chunks.size(), max_gather);
+    for(std::size_t i = 0; i < max_gather; ++i){
+        relay.gather[i] = i < relay.gathered ? boost::asio::const_buffer(relay.chunks[i].first.data(), relay.chunks[i].second) : boost::asio::const_buffer();
+    }
+}
+template<typename Filter>
+void Pipe<Filter>::written(Relay & relay){
+    for(std::size_t i = 0; i < relay.gathered; ++i){
+        relay.queued -= relay.chunks.front().first.capacity();
+        MemoryBudget::instance().charge(-static_cast<long long>(relay.chunks.front().first.capacity()));
+        relay.chunks.pop_front();
+    }
+    relay.gathered = 0;
+    relay.reader_wakeup.cancel();
+}
 
-boost::asio::ip::tcp::socket async_connect(boost::asio::io_service &io, boost::asio::yield_context yield, std::string host, std::string port){
-    boost::asio::ip::tcp::socket socket(io);
-    boost::asio::ip::tcp::resolver::query query_(host, port);
-    boost::asio::ip::tcp::resolver resolver_(io);
-    auto iter = resolver_.async_resolve(query_, yield);
-    boost::asio::async_connect(socket, iter, boost::asio::ip::tcp::resolver::iterator{}, yield);
-    return socket;
+#ifdef SO_REUSEPORT
+// every shard binds its own listener to the same address, the kernel spreads the connections
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+// the listener of a shard: taken over from the process this one replaces when that one listened
+// on the same address, else bound here
+void open_listener(boost::asio::ip::tcp::acceptor & acceptor, boost::asio::ip::tcp::endpoint const & endpoint, SocketProfile const & profile){
+    auto fd = Listeners::instance().take(endpoint);
+    if(fd >= 0){
+        acceptor.assign(endpoint.protocol(), fd);
+    }else{
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        acceptor.set_option(reuse_port(true));
+#endif
+        boost::system::error_code ec;
+        profile.apply_listener(acceptor, ec);
+        if(ec)
+            std::cerr << "WARNING : listen socket option not set, " << ec.message() << std::endl;
+        acceptor.bind(endpoint);
+        acceptor.listen(profile.listen_backlog());
+    }
+    Listeners::instance().add(acceptor.native_handle());
 }
 
+// command line settings handed to every server shard
+struct Options{
+    // the filter policy of the listener's pipes, false: NullFilter
+    bool inspect = true;
+    // AcceptServer: connections to the destination kept ready per shard, 0 disables the pool
+    std::size_t pool_size = 0;
+    std::chrono::seconds pool_max_idle{30};
+    // AcceptServer: probe every destination this often, 0 relies on failed connects only
+    std::chrono::seconds health_interval{0};
+    // --config
+    SocketConfig sockets{};
+    // 0 disables a timeout
+    std::chrono::seconds connect_timeout{10};
+    std::chrono::seconds handshake_timeout{10};
+    std::chrono::seconds idle_timeout{0};
+    // bytes of stack of a handshake/connect coroutine, 0 keeps the Boost.Coroutine default
+    std::size_t stack_size = 0;
+    // relay with UringRelay instead of the reactor, checked with UringRelay::supported()
+    bool io_uring = false;
+    boost::coroutines::attributes coroutine_attributes() const{
+        if(stack_size == 0)
+            return boost::coroutines::attributes();
+        return boost::coroutines::attributes(std::max(stack_size, boost::coroutines::stack_traits::minimum_size()));
+    }
+};
+
 void output_char_array(std::basic_ostream<char> &out, unsigned char * arr, int len){
     for(int i=0;i<len;++i){
         out << static_cast<int>(arr[i]);
@@ -278,15 +819,12 @@ void output_char_array(std::basic_ostream<char> &out, unsigned char * arr, int l
 class SOCKS5Server
 {
 public:
-    SOCKS5Server(boost::asio::io_service& io_service, std::string const & host,std::string const & port)
-        : acceptor_(io_service), socket_(io_service)
+    SOCKS5Server(boost::asio::io_service& io_service, std::string const & host,std::string const & port, Options const & options = Options{})
+        : acceptor_(io_service), socket_(io_service), options_(options)
     {
         try{
             boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(host), std::atoi(port.c_str()));
-            acceptor_.open(endpoint.protocol());
-            acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-            acceptor_.bind(endpoint);
-            acceptor_.listen();
+            open_listener(acceptor_, endpoint, options_.sockets.listen);
         }catch(std::exception const &e){
             std::cerr << "ERROR : Failed to bind address" << std::endl;
             std::cerr << e.what() << std::endl;
@@ -298,79 +836,151 @@ public:
     unsigned short get_port(void){
         return acceptor_.local_endpoint().port();
     }
+    // drain: the connections being relayed go on, queued ones are left to the listener's other owners
+    void stop_accepting(){
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+    }
 
 private:
+    static bool udp_associate(socks5::Request const & request){
+#ifdef __linux__
+        // the client's source is given as an address, or left all zeros
+        boost::system::error_code ec;
+        boost::asio::ip::address::from_string(request.host, ec);
+        return request.command == socks5::command_udp_associate && ! ec;
+#else
+        (void)request;
+        return false;
+#endif
+    }
+    // initial: what the client sent behind its request
+    template<typename Filter>
+    void start_pipe(std::shared_ptr<Pipe<Filter>> const & pipe, RelayBuffer initial, std::size_t initial_length){
+        pipe->idle_timeout = options_.idle_timeout;
+        pipe->io_uring = options_.io_uring;
+        pipe->start(std::move(initial), initial_length);
+    }
     void do_accept()
     {
         acceptor_.async_accept(socket_,
                                [this](boost::system::error_code ec)
         {
+            if(! acceptor_.is_open())
+                return;
             if (!ec)
             {
+                boost::system::error_code ignored;
+                options_.sockets.listen.apply(socket_, ignored);
                 auto & io= socket_.get_io_service();
-                auto func = [socket = std::move(socket_)](boost::asio::yield_context yield) mutable{
-                    {
-                        char buf[2];
-                        boost::asio::async_read(socket, boost::asio::buffer(buf), yield);
-                        if(buf[0] != 5){
-                            std::cerr << "ERROR: Only Support SOCKS5\n";
-                            return;
+                auto func = [this, socket = std::move(socket_), inspect = options_.inspect, accepted = std::chrono::steady_clock::now(), session = Session()](boost::asio::yield_context yield) mutable{
+                    // the handshake is parsed from whatever has arrived, payload pipelined behind it is kept for the Pipe
+                    ScopedTimeout handshake_deadline(socket.get_io_service(), options_.handshake_timeout, [&socket](){
+                        Metrics::local().error("handshake", boost::asio::error::timed_out);
+                        boost::system::error_code ignored;
+                        socket.close(ignored);
+                    });
+                    auto buf = RelayBuffer::allocate();
+                    auto data = reinterpret_cast<unsigned char *>(buf.data());
+                    std::size_t size = 0;
+                    std::size_t consumed = 0;
+                    auto read_more = [&](){
+                        size += socket.async_read_some(boost::asio::buffer(data + size, buf.capacity() - size), yield);
+                    };
+                    socks5::Status status;
+                    while((status = socks5::parse_greeting(data, size, consumed)) == socks5::Status::incomplete){
+                        read_more();
+                    }
+                    if(status == socks5::Status::bad_version){
+                        std::cerr << "ERROR: Only Support SOCKS5\n";
+                        return;
+                    }
+                    if(status == socks5::Status::no_acceptable_method){
+                        unsigned char reply[] = {0x05, 0xff};
+                        boost::asio::async_write(socket, boost::asio::buffer(reply), yield);
+                        std::cerr << "ERROR: only support \"No authentication\" authentication\n";
+                        return;
+                    }
+                    auto offset = consumed;
+                    // the method selection goes out with the request reply when the request is already in
+                    unsigned char reply[2 + 22] = {0x05, 0x00};
+                    std::size_t reply_size = 2;
+                    socks5::Request request;
+                    while((status = socks5::parse_request(data + offset, size - offset, consumed, request)) == socks5::Status::incomplete){
+                        if(reply_size == 2){
+                            boost::asio::async_write(socket, boost::asio::buffer(reply, reply_size), yield);
+                            reply_size = 0;
                         }
-                        int n = buf[1];
-                        std::vector<char> methods(n);
-                        boost::asio::async_read(socket, boost::asio::buffer(methods), yield);
-                        if(std::find(std::begin(methods), std::end(methods), '\x00') == std::end(methods)){
-                            char buf[] = {'\x05', '\xff'};
-                            boost::asio::async_write(socket,boost::asio::buffer(buf), yield);
-                            std::cerr << "ERROR: only support \"No authentication\" authentication\n";
-                            return;
-                        }else{
-                            char buf[] = {'\x05', '\x00'};
-                            boost::asio::async_write(socket, boost::asio::buffer(buf), yield);
+                        read_more();
+                    }
+                    boost::system::error_code ec;
+                    auto rep = socks5::succeeded;
+                    if(status == socks5::Status::bad_address_type){
+                        rep = socks5::address_type_not_supported;
+                    }else if(status != socks5::Status::ok || (request.command != socks5::command_connect && ! udp_associate(request))){
+                        rep = socks5::command_not_supported;
+                    }
+                    boost::asio::ip::tcp::socket dst_socket(socket.get_io_service());
+#ifdef __linux__
+                    std::shared_ptr<UdpAssociation> association;
+                    if(rep == socks5::succeeded && request.command == socks5::command_udp_associate){
+                        try{
+                            // DST.ADDR/DST.PORT is where the client will send from, zeros when it does not know yet
+                            auto client = boost::asio::ip::address::from_string(request.host);
+                            if(client.is_unspecified())
+                                client = socket.remote_endpoint().address();
+                            association = std::make_shared<UdpAssociation>(socket.get_io_service(), socket.local_endpoint().address(), boost::asio::ip::udp::endpoint(client, request.port));
+                        }catch(boost::system::system_error const & e){
+                            Metrics::local().error("udp", e.code());
+                            rep = socks5::general_failure;
+                        }
+                    }else
+#endif
+                    if(rep == socks5::succeeded){
+                        try{
+                            auto port = std::to_string(request.port);
+                            async_connect_socket(dst_socket, yield, request.host, port, options_.sockets.upstream_for(request.host, port), options_.connect_timeout);
+                        }catch(boost::system::system_error const & e){
+                            rep = socks5::reply_of(e.code());
                         }
                     }
-                    unsigned char buf[32];
-                    socket.async_read_some(boost::asio::buffer(buf, 4), yield);
-                    if (buf[0] != 0x05 || buf[1] != 0x01){
-                        char buf[] = {0x05, 0x08};
-                        boost::asio::async_write(socket, boost::asio::buffer(buf), yield);
+                    if(rep != socks5::succeeded){
+                        reply_size += socks5::write_reply(reply + reply_size, rep, boost::asio::ip::address_v4(), 0);
+                        boost::asio::async_write(socket, boost::asio::buffer(reply, reply_size), yield[ec]);
                         return;
                     }
-                    if (buf[3] == 0x01){
-                        boost::asio::ip::address_v4::bytes_type ip_buf;
-                        boost::asio::async_read(socket, boost::asio::buffer(ip_buf), yield);
-                        boost::asio::ip::address_v4 dst_ip(ip_buf);
-                        unsigned char port_buf[2];
-                        boost::asio::async_read(socket, boost::asio::buffer(port_buf), yield);
-                        int port = (port_buf[0] << 8) + port_buf[1];
-//                        std::cerr << dst_ip.to_string() << " " << std::to_string(port) << "\n";
-                        boost::asio::ip::tcp::socket dst_socket = async_connect(socket.get_io_service(), yield, dst_ip.to_string(), std::to_string(port));
-//                        std::cerr << "connected\n";
-                        unsigned char buf_[] = {0x05, 0x00, 0x00, 0x01, ip_buf[0], ip_buf[1], ip_buf[2], ip_buf[3], port_buf[0], port_buf[1]};
-                        boost::asio::async_write(socket, boost::asio::buffer(buf_), yield);
-                        std::make_shared<Pipe>(std::move(socket), std::move(dst_socket))->start();
-                    }else if(buf[3] == 0x03){
-                        unsigned char len_buf[1];
-                        boost::asio::async_read(socket, boost::asio::buffer(len_buf), yield);
-                        int len = static_cast<int>(len_buf[0]);
-                        unsigned char address[255];
-                        boost::asio::async_read(socket, boost::asio::buffer(address, len + 2), yield);
-//                        output_char_array(std::cerr, address, 255);
-                        std::string host(std::begin(address), std::begin(address) + len);
-                        int port = (address[len] << 8) + address[len + 1];
-//                        std::cerr << host << " " << std::to_string(port) << "\n";
-                        boost::asio::ip::tcp::socket dst_socket = async_connect(socket.get_io_service(), yield, host, std::to_string(port));
-//                        std::cerr << "connected\n";
-                        unsigned char buf[] = {0x05, 0x00, 0x00, 0x03, len_buf[0]};
-                        boost::asio::async_write(socket, boost::asio::buffer(buf), yield);
-                        boost::asio::async_write(socket, boost::asio::buffer(address, len + 2), yield);
-                        std::make_shared<Pipe>(std::move(socket), std::move(dst_socket))->start();
+#ifdef __linux__
+                    if(association){
+                        auto bound = association->local_endpoint();
+                        reply_size += socks5::write_reply(reply + reply_size, rep, bound.address(), bound.port());
+                        boost::asio::async_write(socket, boost::asio::buffer(reply, reply_size), yield);
+                        Metrics::local().socks5_handshake.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - accepted).count());
+                        handshake_deadline.cancel();
+                        association->start();
+                        // the association ends with its control connection, which carries nothing else
+                        while(! ec){
+                            socket.async_read_some(boost::asio::buffer(data, buf.capacity()), yield[ec]);
+                        }
+                        association->close();
+                        return;
+                    }
+#endif
+                    auto bound = dst_socket.local_endpoint();
+                    reply_size += socks5::write_reply(reply + reply_size, rep, bound.address(), bound.port());
+                    boost::asio::async_write(socket, boost::asio::buffer(reply, reply_size), yield);
+                    Metrics::local().socks5_handshake.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - accepted).count());
+                    offset += consumed;
+                    std::memmove(data, data + offset, size - offset);
+                    handshake_deadline.cancel();
+                    if(inspect){
+                        start_pipe(std::make_shared<Pipe<HttpFilter>>(std::move(socket), std::move(dst_socket)), std::move(buf), size - offset);
                     }else{
-                        unsigned char buf[] = {0x05, 0x08};
-                        boost::asio::async_write(socket, boost::asio::buffer(buf), yield);
+                        start_pipe(std::make_shared<Pipe<NullFilter>>(std::move(socket), std::move(dst_socket)), std::move(buf), size - offset);
                     }
                 };
-                boost::asio::spawn(io, CoroutineWrapper<decltype(func)>(std::move(func)));
+                boost::asio::spawn(io, CoroutineWrapper<decltype(func)>(std::move(func)), options_.coroutine_attributes());
+            }else{
+                Metrics::local().error("accept", ec);
             }
 
             do_accept();
@@ -379,20 +989,27 @@ private:
 
     boost::asio::ip::tcp::acceptor acceptor_;
     boost::asio::ip::tcp::socket socket_;
+    Options options_;
 };
 
 class AcceptServer
 {
 public:
-    AcceptServer(boost::asio::io_service& io_service, std::string const & host,std::string const & port,std::string const & dst_host, std::string const & dst_port)
-        : acceptor_(io_service), socket_(io_service), dst_host_(dst_host), dst_port_(dst_port)
+    AcceptServer(boost::asio::io_service& io_service, std::string const & host,std::string const & port, std::shared_ptr<UpstreamGroup> const & upstreams, Options const & options = Options{})
+        : acceptor_(io_service), socket_(io_service), balancer_(upstreams), options_(options)
     {
         try{
             boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(host), std::atoi(port.c_str()));
-            acceptor_.open(endpoint.protocol());
-            acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-            acceptor_.bind(endpoint);
-            acceptor_.listen();
+            open_listener(acceptor_, endpoint, options_.sockets.listen);
+            pools_.resize(upstreams->size());
+            if(options_.pool_size > 0){
+                for(std::size_t i = 0; i < upstreams->size(); ++i){
+                    auto & backend = upstreams->backend(i);
+                    pools_[i].reset(new UpstreamPool(io_service, backend.host, backend.port, options_.pool_size, options_.pool_max_idle, backend.profile, options_.connect_timeout));
+                    pools_[i]->start();
+                }
+            }
+            upstreams->start_health_checks(io_service, options_.health_interval);
             do_accept();
         }catch(std::exception const &e){
 #if PORT_FORWARD_ENABLE_STACK_TRACE
@@ -409,21 +1026,72 @@ public:
     unsigned short get_port(void){
         return acceptor_.local_endpoint().port();
     }
+    // drain: the connections being relayed go on, queued ones are left to the listener's other owners
+    void stop_accepting(){
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+    }
 
 private:
+    void start_pipe(boost::asio::ip::tcp::socket && socket, boost::asio::ip::tcp::socket && socket_dst, std::size_t index){
+        if(options_.inspect){
+            start_pipe(std::make_shared<Pipe<HttpFilter>>(std::move(socket), std::move(socket_dst)), index);
+        }else{
+            start_pipe(std::make_shared<Pipe<NullFilter>>(std::move(socket), std::move(socket_dst)), index);
+        }
+    }
+    template<typename Filter>
+    void start_pipe(std::shared_ptr<Pipe<Filter>> const & pipe, std::size_t index){
+        pipe->idle_timeout = options_.idle_timeout;
+        pipe->io_uring = options_.io_uring;
+        // may run after this server is gone: pipes still open when the drain gives up die with the io_service
+        pipe->on_close = balancer_.acquire(index);
+        pipe->start();
+    }
     void do_accept()
     {
         acceptor_.async_accept(socket_,
                                [this](boost::system::error_code ec)
         {
+            if(! acceptor_.is_open())
+                return;
             if (!ec)
             {
+                boost::system::error_code ignored;
+                options_.sockets.listen.apply(socket_, ignored);
                 auto & io= socket_.get_io_service();
-                auto func = [socket = std::move(socket_), dst_host=dst_host_, dst_port=dst_port_](boost::asio::yield_context yield) mutable{
-                    auto socket_dst = async_connect(socket.get_io_service(), yield, dst_host, dst_port);
-                    std::make_shared<Pipe>(std::move(socket), std::move(socket_dst))->start();
-                };
-                boost::asio::spawn(io, CoroutineWrapper<decltype(func)>(std::move(func)));
+                auto client = socket_.remote_endpoint(ec).address();
+                auto & group = balancer_.group();
+                std::vector<bool> tried(group.size());
+                auto index = balancer_.pick(client, tried);
+                boost::asio::ip::tcp::socket socket_dst(io);
+                if(pools_[index] && pools_[index]->take(socket_dst)){
+                    start_pipe(std::move(socket_), std::move(socket_dst), index);
+                }else{
+                    auto func = [this, socket = std::move(socket_), client, tried, index, session = Session()](boost::asio::yield_context yield) mutable{
+                        auto & group = balancer_.group();
+                        // a failed backend is reported and the next one is tried
+                        while(true){
+                            auto & backend = group.backend(index);
+                            try{
+                                auto socket_dst = async_connect(socket.get_io_service(), yield, backend.host, backend.port, backend.profile, options_.connect_timeout);
+                                group.report_success(index);
+                                start_pipe(std::move(socket), std::move(socket_dst), index);
+                                return;
+                            }catch(boost::system::system_error const &){
+                                group.report_failure(index);
+                                tried[index] = true;
+                                auto next = balancer_.pick(client, tried);
+                                if(next == group.size())
+                                    throw;
+                                index = next;
+                            }
+                        }
+                    };
+                    boost::asio::spawn(io, CoroutineWrapper<decltype(func)>(std::move(func)), options_.coroutine_attributes());
+                }
+            }else{
+                Metrics::local().error("accept", ec);
             }
 
             do_accept();
@@ -432,46 +1100,435 @@ private:
 
     boost::asio::ip::tcp::acceptor acceptor_;
     boost::asio::ip::tcp::socket socket_;
-    std::string dst_host_;
-    std::string dst_port_;
+    Balancer balancer_;
+    Options options_;
+    // per backend, empty without --pool
+    std::vector<std::unique_ptr<UpstreamPool>> pools_{};
 };
 
+void pin_to_cpu(unsigned int index){
+#ifdef __linux__
+    auto cpus = boost::thread::hardware_concurrency();
+    if(cpus == 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)index;
+#endif
+}
+
+// zero-downtime restarts, see handover.h
+struct Restart{
+    // connected to the process this one replaces, told once the listeners accept; -1 none
+    int predecessor = -1;
+    // --handover: a successor connects here for the listeners
+    std::string path;
+    // how long a replaced or terminated process waits for its connections
+    std::chrono::seconds drain_timeout{30};
+    // what SIGHUP starts: the command line of this process
+    std::vector<std::string> command;
+    // --admin, stops accepting with the shards; null none
+    AdminServer * admin = nullptr;
+};
+
+/** Lifecycle of the server shards. SIGTERM/SIGINT, or a successor that took over the listeners,
+ *  start the drain: every shard stops accepting and the process ends once its connections are
+ *  closed or the drain timeout passed; a second signal ends it at once. SIGHUP starts the same
+ *  command again, which takes over, so a new binary or config file goes live without a restart. */
+template<typename Server>
+class Supervisor{
+    using local_socket = boost::asio::local::stream_protocol::socket;
+    std::vector<boost::asio::io_service *> services_;
+    std::vector<Server *> servers_;
+    Restart const & restart_;
+    boost::asio::io_service & io_;
+    // the handlers below may run on any thread of io_
+    boost::asio::io_service::strand strand_;
+    boost::asio::signal_set signals_;
+    boost::asio::local::stream_protocol::acceptor successors_;
+    boost::asio::deadline_timer drain_timer_;
+    std::chrono::steady_clock::time_point drain_deadline_{};
+    bool draining_ = false;
+
+    void wait_signal(){
+        signals_.async_wait(strand_.wrap([this](boost::system::error_code ec, int signal){
+            if(ec)
+                return;
+            if(signal == SIGHUP){
+                start_successor();
+            }else if(draining_){
+                stop();
+                return;
+            }else{
+                drain();
+            }
+            wait_signal();
+        }));
+    }
+    void accept_successor(){
+        auto socket = std::make_shared<local_socket>(io_);
+        successors_.async_accept(*socket, strand_.wrap([this, socket](boost::system::error_code ec){
+            if(! successors_.is_open())
+                return;
+            if(! ec)
+                hand_over(socket);
+            accept_successor();
+        }));
+    }
+    void start_successor(){
+        if(draining_)
+            return;
+        int fd = handover::spawn(restart_.command);
+        if(fd < 0){
+            std::cerr << "WARNING : can not start " << restart_.command.front() << ", " << std::strerror(errno) << std::endl;
+            return;
+        }
+        auto socket = std::make_shared<local_socket>(io_);
+        socket->assign(boost::asio::local::stream_protocol(), fd);
+        hand_over(socket);
+    }
+    // the successor answers once it accepts on the listeners, then this process drains
+    void hand_over(std::shared_ptr<local_socket> const & socket){
+        if(draining_ || ! handover::send(socket->native_handle(), Listeners::instance().active()))
+            return;
+        auto ready = std::make_shared<char>();
+        boost::asio::async_read(*socket, boost::asio::buffer(ready.get(), 1), strand_.wrap([this, socket, ready](boost::system::error_code ec, std::size_t){
+            if(ec){
+                std::cerr << "WARNING : the new process did not take over, " << ec.message() << std::endl;
+                return;
+            }
+            drain();
+        }));
+    }
+    void drain(){
+        if(draining_)
+            return;
+        draining_ = true;
+        // a successor owns the path now, only the socket is closed
+        boost::system::error_code ec;
+        successors_.close(ec);
+        for(std::size_t i = 0; i < servers_.size(); ++i){
+            auto server = servers_[i];
+            services_[i % services_.size()]->post([server](){
+                server->stop_accepting();
+            });
+        }
+        if(restart_.admin)
+            restart_.admin->stop_accepting();
+        drain_deadline_ = std::chrono::steady_clock::now() + restart_.drain_timeout;
+        wait_drained();
+    }
+    void wait_drained(){
+        auto & metrics = Metrics::instance();
+        if((metrics.active_pipes() == 0 && metrics.active_sessions() == 0) || std::chrono::steady_clock::now() >= drain_deadline_){
+            stop();
+            return;
+        }
+        drain_timer_.expires_from_now(boost::posix_time::milliseconds(100));
+        drain_timer_.async_wait(strand_.wrap([this](boost::system::error_code ec){
+            if(! ec)
+                wait_drained();
+        }));
+    }
+    void stop(){
+        for(auto io : services_)
+            io->stop();
+    }
+public:
+    Supervisor(std::vector<boost::asio::io_service *> services, std::vector<Server *> servers, Restart const & restart)
+        : services_(std::move(services)), servers_(std::move(servers)), restart_(restart), io_(*services_.front()),
+          strand_(io_), signals_(io_, SIGTERM, SIGINT, SIGHUP), successors_(io_), drain_timer_(io_){
+    }
+    // the servers accept by now
+    void start(){
+        Listeners::instance().close_untaken();
+        if(! restart_.path.empty()){
+            try{
+                ::unlink(restart_.path.c_str());
+                boost::asio::local::stream_protocol::endpoint endpoint(restart_.path);
+                successors_.open(endpoint.protocol());
+                successors_.bind(endpoint);
+                successors_.listen();
+                accept_successor();
+            }catch(boost::system::system_error const & e){
+                std::cerr << "WARNING : no handover socket at " << restart_.path << ", " << e.what() << std::endl;
+            }
+        }
+        if(restart_.predecessor >= 0){
+            char ready = 1;
+            if(::send(restart_.predecessor, &ready, 1, MSG_NOSIGNAL) != 1)
+                std::cerr << "WARNING : the old process did not get the handover answer, " << std::strerror(errno) << std::endl;
+            ::close(restart_.predecessor);
+        }
+        wait_signal();
+    }
+};
+
+// one io_service per thread, every thread pinned to a cpu and owning its own listener,
+// so a connection stays on one core from accept to close
+template<typename Server, typename... Args>
+void run_sharded(int num_of_threads, Restart const & restart, Args const &... args){
+#ifndef SO_REUSEPORT
+    // no way to bind a listener per shard, share one io_service between the threads
+    boost::asio::io_service io_service_;
+    Server s(io_service_, args...);
+    Supervisor<Server> supervisor({&io_service_}, {&s}, restart);
+    supervisor.start();
+    boost::thread_group threads;
+    for(auto i = 1; i < num_of_threads; ++i){
+        threads.create_thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+    }
+    io_service_.run();
+    threads.join_all();
+#else
+    num_of_threads = std::max(num_of_threads, 1);
+    std::vector<std::unique_ptr<boost::asio::io_service>> services;
+    std::vector<std::unique_ptr<Server>> servers;
+    std::vector<boost::asio::io_service *> shard_services;
+    std::vector<Server *> shard_servers;
+    for(auto i = 0; i < num_of_threads; ++i){
+        services.emplace_back(new boost::asio::io_service(1));
+        servers.emplace_back(new Server(*services.back(), args...));
+        shard_services.push_back(services.back().get());
+        shard_servers.push_back(servers.back().get());
+    }
+    Supervisor<Server> supervisor(shard_services, shard_servers, restart);
+    supervisor.start();
+    boost::thread_group threads;
+    for(auto i = 1; i < num_of_threads; ++i){
+        auto io = services[i].get();
+        threads.create_thread([io, i](){
+            pin_to_cpu(i);
+            io->run();
+        });
+    }
+    pin_to_cpu(0);
+    services[0]->run();
+    threads.join_all();
+#endif
+}
+
+// [options] of the --config file as command line arguments, read again by a process started with
+// SIGHUP: "name = value" is --name=value, "name = true" is --name, "upstream = a:1, b:2" repeats --upstream
+static std::vector<std::string> config_arguments(std::string const & path){
+    boost::property_tree::ptree tree;
+    boost::property_tree::ini_parser::read_ini(path, tree);
+    std::vector<std::string> arguments;
+    auto options = tree.get_child_optional("options");
+    if(! options)
+        return arguments;
+    for(auto const & option : *options){
+        auto value = option.second.data();
+        if(option.first == "upstream"){
+            std::istringstream in(value);
+            std::string upstream;
+            while(std::getline(in, upstream, ',')){
+                upstream.erase(0, upstream.find_first_not_of(' '));
+                upstream.erase(upstream.find_last_not_of(' ') + 1);
+                if(! upstream.empty())
+                    arguments.push_back("--upstream=" + upstream);
+            }
+        }else if(value == "true"){
+            arguments.push_back("--" + option.first);
+        }else if(value != "false"){
+            arguments.push_back("--" + option.first + "=" + value);
+        }
+    }
+    return arguments;
+}
+
 int main(int argc, char *argv[])
 {
+    // a process started by SIGHUP that fails is not waited for
+    ::signal(SIGCHLD, SIG_IGN);
     try{
-        if(argc >= 5){
-            auto listen_host = argv[1];
-            auto listen_port = argv[2];
-            auto dst_host = argv[3];
-            auto dst_port = argv[4];
+        Restart restart;
+        restart.command.assign(argv, argv + argc);
+        // SIGHUP starts the binary at the same path, which may have been replaced by then
+        restart.command.front() = handover::executable_path(restart.command.front());
+        std::string config_path;
+        for(auto i = 1; i < argc; ++i){
+            if(std::strncmp(argv[i], "--config=", 9) == 0)
+                config_path = argv[i] + 9;
+        }
+        // the command line comes last and wins
+        std::vector<std::string> arguments;
+        if(! config_path.empty())
+            arguments = config_arguments(config_path);
+        arguments.insert(arguments.end(), argv + 1, argv + argc);
+        std::vector<std::string> args;
+        Options options;
+        std::vector<std::pair<std::string, std::string>> upstreams;
+        auto policy = UpstreamGroup::Policy::round_robin;
+        std::string events_path;
+        auto events_format = EventLog::Format::curl;
+        std::chrono::seconds dns_ttl{60};
+        std::string admin_address;
+        std::string capture_path;
+        std::size_t capture_size = 64;
+        std::uint32_t capture_snaplen = 256;
+        for(auto const & arg : arguments){
+            if(arg == "--no-filter"){
+                options.inspect = false;
+            }else if(arg.compare(0, 7, "--pool=") == 0){
+                options.pool_size = std::atoi(arg.c_str() + 7);
+            }else if(arg.compare(0, 12, "--pool-idle=") == 0){
+                options.pool_max_idle = std::chrono::seconds(std::atoi(arg.c_str() + 12));
+            }else if(arg.compare(0, 11, "--upstream=") == 0){
+                auto destination = arg.substr(11);
+                auto colon = destination.rfind(':');
+                if(colon == std::string::npos)
+                    throw std::invalid_argument("--upstream needs host:port, got " + destination);
+                auto host = destination.substr(0, colon);
+                if(host.size() > 2 && host.front() == '[' && host.back() == ']')
+                    host = host.substr(1, host.size() - 2);
+                upstreams.emplace_back(host, destination.substr(colon + 1));
+            }else if(arg == "--balance=round-robin"){
+                policy = UpstreamGroup::Policy::round_robin;
+            }else if(arg == "--balance=least-conn"){
+                policy = UpstreamGroup::Policy::least_conn;
+            }else if(arg == "--balance=hash"){
+                policy = UpstreamGroup::Policy::hash;
+            }else if(arg.compare(0, 18, "--health-interval=") == 0){
+                options.health_interval = std::chrono::seconds(std::atoi(arg.c_str() + 18));
+            }else if(arg.compare(0, 10, "--dns-ttl=") == 0){
+                dns_ttl = std::chrono::seconds(std::atoi(arg.c_str() + 10));
+            }else if(arg.compare(0, 18, "--connect-timeout=") == 0){
+                options.connect_timeout = std::chrono::seconds(std::atoi(arg.c_str() + 18));
+            }else if(arg.compare(0, 20, "--handshake-timeout=") == 0){
+                options.handshake_timeout = std::chrono::seconds(std::atoi(arg.c_str() + 20));
+            }else if(arg.compare(0, 15, "--idle-timeout=") == 0){
+                options.idle_timeout = std::chrono::seconds(std::atoi(arg.c_str() + 15));
+            }else if(arg.compare(0, 16, "--memory-budget=") == 0){
+                MemoryBudget::instance().set_limit(std::atoll(arg.c_str() + 16) * 1024 * 1024);
+            }else if(arg.compare(0, 13, "--stack-size=") == 0){
+                options.stack_size = std::atoi(arg.c_str() + 13) * 1024;
+            }else if(arg == "--io-uring"){
+                options.io_uring = true;
+            }else if(arg.compare(0, 9, "--config=") == 0){
+                config_path = arg.substr(9);
+            }else if(arg.compare(0, 8, "--admin=") == 0){
+                admin_address = arg.substr(8);
+            }else if(arg.compare(0, 11, "--handover=") == 0){
+                restart.path = arg.substr(11);
+            }else if(arg.compare(0, 16, "--drain-timeout=") == 0){
+                restart.drain_timeout = std::chrono::seconds(std::atoi(arg.c_str() + 16));
+            }else if(arg.compare(0, 10, "--capture=") == 0){
+                capture_path = arg.substr(10);
+            }else if(arg.compare(0, 15, "--capture-size=") == 0){
+                capture_size = std::atol(arg.c_str() + 15);
+            }else if(arg.compare(0, 18, "--capture-snaplen=") == 0){
+                capture_snaplen = std::atol(arg.c_str() + 18);
+            }else if(arg.compare(0, 9, "--events=") == 0){
+                events_path = arg.substr(9);
+            }else if(arg == "--events-format=json"){
+                events_format = EventLog::Format::json;
+            }else if(arg == "--events-format=curl"){
+                events_format = EventLog::Format::curl;
+            }else{
+                args.push_back(arg);
+            }
+        }
+        if(! config_path.empty())
+            options.sockets = SocketConfig::load(config_path);
+        if(options.io_uring){
+#if PORT_FORWARD_HAS_IO_URING
+            std::string reason;
+            if(! UringRelay::supported(reason)){
+                std::cerr << "WARNING : io_uring relay not available, " << reason << ", using epoll" << std::endl;
+                options.io_uring = false;
+            }
+#else
+            std::cerr << "WARNING : built without io_uring, using epoll" << std::endl;
+            options.io_uring = false;
+#endif
+        }
+        if(options.inspect){
+            EventLog::instance().start(events_path, events_format);
+        }
+        ResolverCache::instance().configure(dns_ttl, std::chrono::seconds(5), 4096);
+        // the listeners of the process this one replaces: from systemd, or asked for over --handover
+        // (or the socket a SIGHUP started this process with); the old one drains once these accept
+        auto inherited = handover::systemd_listeners();
+        restart.predecessor = handover::connect(restart.path);
+        if(restart.predecessor >= 0){
+            auto fds = handover::receive(restart.predecessor);
+            inherited.insert(inherited.end(), fds.begin(), fds.end());
+        }
+        Listeners::instance().inherit(inherited);
+        std::unique_ptr<AdminServer> admin;
+        if(! admin_address.empty())
+            admin.reset(new AdminServer(admin_address));
+        restart.admin = admin.get();
+        // the number of shards, then a segment of the capture ring for each
+        auto prepare_shards = [&](int & threads, std::string const & host, std::string const & port){
+            // every inherited listener on the address served needs a shard, its queued connections would
+            // be reset otherwise; the ones bound elsewhere are closed anyway
+            boost::system::error_code ec;
+            auto address = boost::asio::ip::address::from_string(host, ec);
+            auto untaken = ec ? 0 : static_cast<int>(Listeners::instance().untaken(boost::asio::ip::tcp::endpoint(address, std::atoi(port.c_str()))));
+            if(threads < untaken){
+                std::cerr << "WARNING : " << untaken << " listeners taken over, running as many threads" << std::endl;
+                threads = untaken;
+            }
+            if(! capture_path.empty())
+                capture::Capture::instance().open(capture_path, capture_size * 1024 * 1024, std::max(threads, 1), capture_snaplen);
+        };
+        if(args.size() >= 4){
+            auto listen_host = args[0];
+            auto listen_port = args[1];
+            auto dst_host = args[2];
+            auto dst_port = args[3];
             auto num_of_threads = 1;
-            if(argc == 6){
-                num_of_threads = std::atoi(argv[5]);
+            if(args.size() == 5){
+                num_of_threads = std::atoi(args[4].c_str());
             }
-            num_of_threads--;
-
-            using thread_ptr = std::shared_ptr<boost::thread>;
-            std::vector<thread_ptr> threads;
-
-            boost::asio::io_service io_service_;
-            AcceptServer s(io_service_, listen_host, listen_port, dst_host, dst_port);
-            for(auto i = 0; i< num_of_threads;++i){
-                thread_ptr thread(new boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_)));
-                threads.push_back(thread);
+            upstreams.insert(upstreams.begin(), std::make_pair(dst_host, dst_port));
+            auto group = std::make_shared<UpstreamGroup>(upstreams, policy);
+            for(std::size_t i = 0; i < group->size(); ++i){
+                auto & backend = group->backend(i);
+                backend.profile = options.sockets.upstream_for(backend.host, backend.port);
             }
-            for(auto i = 0;i<num_of_threads;++i){
-                threads[i]->join();
+            prepare_shards(num_of_threads, listen_host, listen_port);
+            run_sharded<AcceptServer>(num_of_threads, restart, listen_host, listen_port, group, options);
+        }else if(args.size() == 2 || args.size() == 3){
+            auto listen_host = args[0];
+            auto listen_port = args[1];
+            auto num_of_threads = 1;
+            if(args.size() == 3){
+                num_of_threads = std::atoi(args[2].c_str());
             }
-            io_service_.run();
-        }else if(argc == 3){
-            auto listen_host = argv[1];
-            auto listen_port = argv[2];
-
-            boost::asio::io_service io_service_;
-            SOCKS5Server s(io_service_, listen_host, listen_port);
-            io_service_.run();
+            prepare_shards(num_of_threads, listen_host, listen_port);
+            run_sharded<SOCKS5Server>(num_of_threads, restart, listen_host, listen_port, options);
         }else{
-            std::cout << "Usage: " << argv[0] << " listen_host listen_port [destination_host destination_port [threads]]" << std::endl;
+            std::cout << "Usage: " << argv[0] << " [options] listen_host listen_port [threads]" << std::endl;
+            std::cout << "       " << argv[0] << " [options] listen_host listen_port destination_host destination_port [threads]" << std::endl;
+            std::cout << "Options:" << std::endl;
+            std::cout << "  --no-filter                do not inspect HTTP downloads" << std::endl;
+            std::cout << "  --upstream=HOST:PORT       one more destination, may be repeated" << std::endl;
+            std::cout << "  --balance=POLICY           round-robin (default), least-conn or hash (on the client address)" << std::endl;
+            std::cout << "  --health-interval=SECONDS  probe the destinations this often (off)" << std::endl;
+            std::cout << "  --pool=N                   keep N connections to the destination ready per thread" << std::endl;
+            std::cout << "  --pool-idle=SECONDS        drop pooled connections idle for longer (30)" << std::endl;
+            std::cout << "  --dns-ttl=SECONDS          how long name lookups are cached (60)" << std::endl;
+            std::cout << "  --connect-timeout=SECONDS  give up connecting to a destination (10, 0 never)" << std::endl;
+            std::cout << "  --handshake-timeout=SECONDS  give up on a SOCKS5 client not done with the handshake (10, 0 never)" << std::endl;
+            std::cout << "  --idle-timeout=SECONDS     close connections without traffic for that long (0, never)" << std::endl;
+            std::cout << "  --memory-budget=MB         pause reads while relay buffers use more (0, no limit)" << std::endl;
+            std::cout << "  --io-uring                 relay with io_uring (linux 6.0+), epoll when not available" << std::endl;
+            std::cout << "  --stack-size=KB            stack of the per connection handshake coroutines (Boost default)" << std::endl;
+            std::cout << "  --config=PATH              socket options of the listener and the upstreams (ini file, see README)" << std::endl;
+            std::cout << "  --admin=HOST:PORT          serve live metrics over HTTP, also --admin=unix:PATH" << std::endl;
+            std::cout << "  --handover=PATH            take the listeners over from the process serving PATH (unix socket), then serve it" << std::endl;
+            std::cout << "  --drain-timeout=SECONDS    wait this long for connections after SIGTERM or a takeover (30)" << std::endl;
+            std::cout << "  --capture=PATH             record connections and their first bytes per read into a ring file" << std::endl;
+            std::cout << "  --capture-size=MB          size of the ring file (64), the oldest records are overwritten" << std::endl;
+            std::cout << "  --capture-snaplen=BYTES    payload kept per read (256, 0 metadata only)" << std::endl;
+            std::cout << "  --events=PATH              write matched downloads to PATH (file or fifo) instead of stdout" << std::endl;
+            std::cout << "  --events-format=curl|json  one curl command per download, or one JSON object per line" << std::endl;
             return 1;
         }
         return 0;
@@ -480,4 +1537,3 @@ int main(int argc, char *argv[])
         return 2;
     }
 }
-
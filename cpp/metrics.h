@@ -0,0 +1,292 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/thread.hpp>
+#include <unistd.h>
+#include "buffer_pool.h"
+#include "histogram.h"
+#include "handover.h"
+
+/** Counters of one thread. Only that thread writes them, so updates are plain relaxed stores;
+ *  readers merge all threads on demand. */
+struct ThreadMetrics{
+    enum Direction{client_to_upstream = 0, upstream_to_client = 1};
+    std::atomic<std::uint64_t> bytes[2];
+    // UDP ASSOCIATE, their bytes are in bytes too
+    std::atomic<std::uint64_t> datagrams[2];
+    std::atomic<std::uint64_t> pipes_opened{0};
+    std::atomic<std::uint64_t> pipes_closed{0};
+    // clients not handed to a pipe, see Session
+    std::atomic<std::uint64_t> sessions_opened{0};
+    std::atomic<std::uint64_t> sessions_closed{0};
+    // microseconds
+    Histogram connect_latency{};
+    Histogram socks5_handshake{};
+    // milliseconds
+    Histogram pipe_lifetime{};
+    // (stage, category, value) -> count, errors are rare enough for a lock
+    std::mutex errors_mutex{};
+    std::map<std::tuple<std::string, std::string, int>, std::uint64_t> errors{};
+
+    ThreadMetrics(){
+        bytes[0].store(0, std::memory_order_relaxed);
+        bytes[1].store(0, std::memory_order_relaxed);
+        datagrams[0].store(0, std::memory_order_relaxed);
+        datagrams[1].store(0, std::memory_order_relaxed);
+    }
+    static void bump(std::atomic<std::uint64_t> & counter, std::uint64_t n = 1){
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void add_bytes(Direction direction, std::uint64_t n){
+        bump(bytes[direction], n);
+    }
+    void add_datagrams(Direction direction, std::uint64_t n, std::uint64_t size){
+        bump(datagrams[direction], n);
+        bump(bytes[direction], size);
+    }
+    void error(std::string const & stage, boost::system::error_code const & ec){
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        ++errors[std::make_tuple(stage, std::string(ec.category().name()), ec.value())];
+    }
+};
+
+class Metrics{
+    std::mutex mutex_{};
+    // never shrinks, a thread's counters outlive it
+    std::vector<std::unique_ptr<ThreadMetrics>> threads_{};
+
+    ThreadMetrics & add_thread(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.emplace_back(new ThreadMetrics);
+        return *threads_.back();
+    }
+    static void summary(std::ostringstream & out, std::string const & name, std::string const & help, Histogram const & histogram){
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " summary\n";
+        for(auto q : {0.5, 0.9, 0.99, 0.999}){
+            out << name << "{quantile=\"" << q << "\"} " << histogram.percentile(q) << "\n";
+        }
+        out << name << "_sum " << histogram.sum() << "\n";
+        out << name << "_count " << histogram.count() << "\n";
+    }
+public:
+    static Metrics & instance(){
+        static Metrics metrics;
+        return metrics;
+    }
+    // counters of the calling thread
+    static ThreadMetrics & local(){
+        static thread_local ThreadMetrics * metrics = nullptr;
+        if(! metrics)
+            metrics = &instance().add_thread();
+        return *metrics;
+    }
+    // connections being relayed, all threads
+    std::uint64_t active_pipes(){
+        std::uint64_t opened = 0, closed = 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(auto const & thread : threads_){
+            opened += thread->pipes_opened.load(std::memory_order_relaxed);
+            closed += thread->pipes_closed.load(std::memory_order_relaxed);
+        }
+        return opened >= closed ? opened - closed : 0;
+    }
+    // Session objects alive, all threads
+    std::uint64_t active_sessions(){
+        std::uint64_t opened = 0, closed = 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(auto const & thread : threads_){
+            opened += thread->sessions_opened.load(std::memory_order_relaxed);
+            closed += thread->sessions_closed.load(std::memory_order_relaxed);
+        }
+        return opened >= closed ? opened - closed : 0;
+    }
+    // all threads merged, in the Prometheus text format
+    std::string render(){
+        std::uint64_t bytes[2] = {0, 0};
+        std::uint64_t datagrams[2] = {0, 0};
+        std::uint64_t opened = 0, closed = 0;
+        std::uint64_t sessions_opened = 0, sessions_closed = 0;
+        Histogram connect_latency, socks5_handshake, pipe_lifetime;
+        std::map<std::tuple<std::string, std::string, int>, std::uint64_t> errors;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for(auto const & thread : threads_){
+                bytes[0] += thread->bytes[0].load(std::memory_order_relaxed);
+                bytes[1] += thread->bytes[1].load(std::memory_order_relaxed);
+                datagrams[0] += thread->datagrams[0].load(std::memory_order_relaxed);
+                datagrams[1] += thread->datagrams[1].load(std::memory_order_relaxed);
+                opened += thread->pipes_opened.load(std::memory_order_relaxed);
+                closed += thread->pipes_closed.load(std::memory_order_relaxed);
+                sessions_opened += thread->sessions_opened.load(std::memory_order_relaxed);
+                sessions_closed += thread->sessions_closed.load(std::memory_order_relaxed);
+                connect_latency.merge(thread->connect_latency);
+                socks5_handshake.merge(thread->socks5_handshake);
+                pipe_lifetime.merge(thread->pipe_lifetime);
+                std::lock_guard<std::mutex> errors_lock(thread->errors_mutex);
+                for(auto const & error : thread->errors){
+                    errors[error.first] += error.second;
+                }
+            }
+        }
+        std::ostringstream out;
+        out << "# HELP port_forward_bytes_total Bytes relayed.\n";
+        out << "# TYPE port_forward_bytes_total counter\n";
+        out << "port_forward_bytes_total{direction=\"client_to_upstream\"} " << bytes[0] << "\n";
+        out << "port_forward_bytes_total{direction=\"upstream_to_client\"} " << bytes[1] << "\n";
+        out << "# HELP port_forward_udp_datagrams_total Datagrams relayed for SOCKS5 UDP associations.\n";
+        out << "# TYPE port_forward_udp_datagrams_total counter\n";
+        out << "port_forward_udp_datagrams_total{direction=\"client_to_upstream\"} " << datagrams[0] << "\n";
+        out << "port_forward_udp_datagrams_total{direction=\"upstream_to_client\"} " << datagrams[1] << "\n";
+        out << "# HELP port_forward_pipes_active Connections being relayed.\n";
+        out << "# TYPE port_forward_pipes_active gauge\n";
+        out << "port_forward_pipes_active " << (opened >= closed ? opened - closed : 0) << "\n";
+        out << "# HELP port_forward_pipes_total Connections relayed.\n";
+        out << "# TYPE port_forward_pipes_total counter\n";
+        out << "port_forward_pipes_total " << opened << "\n";
+        out << "# HELP port_forward_sessions_active Clients in the SOCKS5 handshake, connecting, or holding a UDP association.\n";
+        out << "# TYPE port_forward_sessions_active gauge\n";
+        out << "port_forward_sessions_active " << (sessions_opened >= sessions_closed ? sessions_opened - sessions_closed : 0) << "\n";
+        out << "# HELP port_forward_buffer_bytes Relay buffer memory queued, see --memory-budget.\n";
+        out << "# TYPE port_forward_buffer_bytes gauge\n";
+        out << "port_forward_buffer_bytes " << std::max(MemoryBudget::instance().used(), 0LL) << "\n";
+        out << "# HELP port_forward_errors_total Failed accepts, resolves and connects, timeouts.\n";
+        out << "# TYPE port_forward_errors_total counter\n";
+        for(auto const & error : errors){
+            out << "port_forward_errors_total{stage=\"" << std::get<0>(error.first) << "\",category=\"" << std::get<1>(error.first) << "\",value=\"" << std::get<2>(error.first) << "\"} " << error.second << "\n";
+        }
+        summary(out, "port_forward_connect_latency_microseconds", "Upstream connect time, name lookup included.", connect_latency);
+        summary(out, "port_forward_socks5_handshake_microseconds", "SOCKS5 accept to reply.", socks5_handshake);
+        summary(out, "port_forward_pipe_lifetime_milliseconds", "Relayed connection lifetime.", pipe_lifetime);
+        return out.str();
+    }
+};
+
+/** A client from accept until its coroutine ends: the SOCKS5 handshake, the connect to the
+ *  destination, a UDP association. Counted like the pipes, so a drain waits for these too. */
+class Session{
+    bool counted_ = true;
+public:
+    Session(){
+        ThreadMetrics::bump(Metrics::local().sessions_opened);
+    }
+    Session(Session && other):counted_(other.counted_){
+        other.counted_ = false;
+    }
+    Session(Session const &) = delete;
+    Session & operator=(Session const &) = delete;
+    ~Session(){
+        // the coroutine may have moved to another thread, the counts are summed
+        if(counted_)
+            ThreadMetrics::bump(Metrics::local().sessions_closed);
+    }
+};
+
+/** Answers any HTTP request with Metrics::render(). Runs on its own thread, off the relay path;
+ *  listens on loopback tcp ("host:port") or a unix socket ("unix:/path"). */
+class AdminServer{
+    // a client gets this long for its request and the answer
+    static const long request_timeout_s = 10;
+    // pause after a failed accept, EMFILE most likely, before trying again
+    static const long accept_backoff_ms = 100;
+    boost::asio::io_service io_{};
+    boost::thread thread_{};
+    // close the acceptors, run on io_
+    std::vector<std::function<void()>> closers_{};
+
+    template<typename Socket>
+    void serve(std::shared_ptr<Socket> const & socket, boost::asio::yield_context yield){
+        boost::asio::deadline_timer deadline(io_, boost::posix_time::seconds(request_timeout_s));
+        deadline.async_wait([socket](boost::system::error_code const & ec){
+            boost::system::error_code ignored;
+            if(! ec)
+                socket->close(ignored);
+        });
+        boost::asio::streambuf request(8192);
+        boost::system::error_code ec;
+        boost::asio::async_read_until(*socket, request, "\r\n\r\n", yield[ec]);
+        if(ec)
+            return;
+        auto body = Metrics::instance().render();
+        std::string head = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        std::vector<boost::asio::const_buffer> buffers{boost::asio::buffer(head), boost::asio::buffer(body)};
+        boost::asio::async_write(*socket, buffers, yield[ec]);
+    }
+    // one coroutine per client, so a slow one holds up nobody
+    template<typename Protocol>
+    void listen(std::shared_ptr<typename Protocol::acceptor> const & acceptor){
+        closers_.push_back([acceptor](){
+            boost::system::error_code ignored;
+            acceptor->close(ignored);
+        });
+        boost::asio::spawn(io_, [this, acceptor](boost::asio::yield_context yield){
+            boost::asio::deadline_timer backoff(io_);
+            while(true){
+                auto socket = std::make_shared<typename Protocol::socket>(io_);
+                boost::system::error_code ec;
+                acceptor->async_accept(*socket, yield[ec]);
+                if(! acceptor->is_open())
+                    return;
+                if(ec){
+                    backoff.expires_from_now(boost::posix_time::milliseconds(accept_backoff_ms));
+                    backoff.async_wait(yield[ec]);
+                    continue;
+                }
+                boost::asio::spawn(io_, [this, socket](boost::asio::yield_context yield){
+                    serve(socket, yield);
+                });
+            }
+        });
+    }
+public:
+    explicit AdminServer(std::string const & address){
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        if(address.compare(0, 5, "unix:") == 0){
+            auto path = address.substr(5);
+            ::unlink(path.c_str());
+            listen<boost::asio::local::stream_protocol>(std::make_shared<boost::asio::local::stream_protocol::acceptor>(io_, boost::asio::local::stream_protocol::endpoint(path)));
+        }else
+#endif
+        {
+            auto colon = address.rfind(':');
+            if(colon == std::string::npos)
+                throw std::invalid_argument("admin address needs host:port or unix:path, got " + address);
+            boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address::from_string(address.substr(0, colon)), std::atoi(address.c_str() + colon + 1));
+            // taken over from the process this one replaces, when it had the same address
+            auto fd = Listeners::instance().take(endpoint);
+            auto acceptor = fd < 0 ? std::make_shared<boost::asio::ip::tcp::acceptor>(io_, endpoint) : std::make_shared<boost::asio::ip::tcp::acceptor>(io_, endpoint.protocol(), fd);
+            Listeners::instance().add(acceptor->native_handle());
+            listen<boost::asio::ip::tcp>(acceptor);
+        }
+        thread_ = boost::thread([this](){
+            io_.run();
+        });
+    }
+    // drain: a successor took the listener over, or the process ends; clients being served finish
+    void stop_accepting(){
+        io_.post([this](){
+            for(auto & close : closers_)
+                close();
+        });
+    }
+    ~AdminServer(){
+        io_.stop();
+        if(thread_.joinable())
+            thread_.join();
+    }
+};
+
+#endif
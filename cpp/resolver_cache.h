@@ -0,0 +1,248 @@
+#ifndef _RESOLVER_CACHE_H_
+#define _RESOLVER_CACHE_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "socket_profile.h"
+#include "timer_wheel.h"
+
+/** Name lookups shared by all the io_services.
+ *  Results are kept for `ttl` (failures for `negative_ttl`), the number of names is bounded
+ *  with LRU eviction, and concurrent lookups of one name wait for a single resolver query,
+ *  each for as long as its own timeout allows. */
+class ResolverCache{
+public:
+    using endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+private:
+    using handler_type = boost::asio::handler_type<boost::asio::yield_context, void(boost::system::error_code)>::type;
+    struct Entry{
+        bool done = false;
+        boost::system::error_code error{};
+        endpoints result{};
+        std::chrono::steady_clock::time_point expires{};
+        // coroutines waiting for the lookup in flight
+        std::vector<std::function<void()>> waiters{};
+        std::list<std::string>::iterator lru{};
+    };
+    std::mutex mutex_{};
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries_{};
+    // most recently used first
+    std::list<std::string> lru_{};
+    std::chrono::seconds ttl_{60};
+    std::chrono::seconds negative_ttl_{5};
+    std::size_t max_entries_ = 4096;
+
+    static int parse_port(std::string const & port){
+        if(port.empty() || port.size() > 5)
+            return -1;
+        auto value = 0;
+        for(auto c : port){
+            if(c < '0' || c > '9')
+                return -1;
+            value = value * 10 + (c - '0');
+        }
+        return value <= 65535 ? value : -1;
+    }
+    // called locked
+    endpoints result_of(Entry const & entry){
+        if(entry.error)
+            throw boost::system::system_error(entry.error);
+        return entry.result;
+    }
+    // called locked
+    void insert(std::string const & key, std::shared_ptr<Entry> const & entry){
+        auto iter = entries_.find(key);
+        if(iter != entries_.end()){
+            lru_.erase(iter->second->lru);
+            iter->second = entry;
+        }else{
+            entries_.emplace(key, entry);
+        }
+        lru_.push_front(key);
+        entry->lru = lru_.begin();
+        // a lookup in flight may be evicted too, its waiters hold the entry
+        while(entries_.size() > max_entries_){
+            entries_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+    // throws timed_out when the lookup is not done within timeout (0: no limit), it goes on for the others
+    void wait_for(boost::asio::io_service & io, boost::asio::yield_context yield, std::shared_ptr<Entry> const & entry, std::chrono::milliseconds timeout){
+        boost::system::error_code ec;
+        handler_type handler(yield[ec]);
+        boost::asio::async_result<handler_type> result(handler);
+        // the lookup and the timeout race from different threads, the first one resumes the
+        // coroutine, on the waiter's own io_service
+        auto resumed = std::make_shared<std::atomic<bool>>(false);
+        auto resume = [&io, handler, resumed](boost::system::error_code const & error) mutable{
+            if(resumed->exchange(true))
+                return;
+            io.post([handler, error]() mutable{
+                handler(error);
+            });
+        };
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(entry->done)
+                return;
+            entry->waiters.push_back([resume]() mutable{
+                resume(boost::system::error_code{});
+            });
+        }
+        ScopedTimeout deadline(io, timeout, [resume]() mutable{
+            resume(boost::asio::error::timed_out);
+        });
+        result.get();
+        if(ec){
+            Metrics::local().error("resolve", ec);
+            throw boost::system::system_error(ec);
+        }
+    }
+    // the query runs on its own, not bound to the coroutine that started it
+    void lookup(boost::asio::io_service & io, std::string const & host, std::string const & port, std::shared_ptr<Entry> const & entry){
+        auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(io);
+        boost::asio::ip::tcp::resolver::query query(host, port);
+        resolver->async_resolve(query, [this, resolver, entry](boost::system::error_code error, boost::asio::ip::tcp::resolver::iterator iter){
+            endpoints result;
+            for(; iter != boost::asio::ip::tcp::resolver::iterator{}; ++iter){
+                result.push_back(iter->endpoint());
+            }
+            if(! error && result.empty())
+                error = boost::asio::error::host_not_found;
+            if(error)
+                Metrics::local().error("resolve", error);
+            std::vector<std::function<void()>> waiters;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                entry->done = true;
+                entry->error = error;
+                entry->result = result;
+                entry->expires = std::chrono::steady_clock::now() + (error ? negative_ttl_ : ttl_);
+                std::swap(waiters, entry->waiters);
+            }
+            for(auto & waiter : waiters){
+                waiter();
+            }
+        });
+    }
+public:
+    static ResolverCache & instance(){
+        static ResolverCache cache;
+        return cache;
+    }
+    void configure(std::chrono::seconds ttl, std::chrono::seconds negative_ttl, std::size_t max_entries){
+        std::lock_guard<std::mutex> lock(mutex_);
+        ttl_ = ttl;
+        negative_ttl_ = negative_ttl;
+        max_entries_ = std::max<std::size_t>(max_entries, 1);
+    }
+    // throws system_error like tcp::resolver, the negative results included, and timed_out after timeout (0: none)
+    endpoints resolve(boost::asio::io_service & io, boost::asio::yield_context yield, std::string const & host, std::string const & port, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)){
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::address::from_string(host, ec);
+        auto port_number = parse_port(port);
+        if(! ec && port_number >= 0)
+            return endpoints{boost::asio::ip::tcp::endpoint(address, static_cast<unsigned short>(port_number))};
+        auto key = host + ":" + port;
+        std::shared_ptr<Entry> entry;
+        auto leader = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto iter = entries_.find(key);
+            if(iter != entries_.end() && (! iter->second->done || std::chrono::steady_clock::now() < iter->second->expires)){
+                entry = iter->second;
+                lru_.splice(lru_.begin(), lru_, entry->lru);
+                if(entry->done)
+                    return result_of(*entry);
+            }else{
+                // this coroutine does the lookup for everyone
+                entry = std::make_shared<Entry>();
+                insert(key, entry);
+                leader = true;
+            }
+        }
+        if(leader)
+            lookup(io, host, port, entry);
+        wait_for(io, yield, entry, timeout);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return result_of(*entry);
+    }
+};
+
+// connects the given socket, so the caller may close it to give up.
+// timeout (0: none) bounds the name lookup and the connect attempts together, they then fail with timed_out
+inline void async_connect_socket(boost::asio::ip::tcp::socket & socket, boost::asio::yield_context yield, std::string const & host, std::string const & port, SocketProfile const & profile = SocketProfile{}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)){
+    auto started = std::chrono::steady_clock::now();
+    auto endpoints = ResolverCache::instance().resolve(socket.get_io_service(), yield, host, port, timeout);
+    boost::system::error_code ec = boost::asio::error::host_not_found;
+    // the deadline may fire on another thread than the one running the coroutine, so it does not
+    // touch the socket object: it shuts down the descriptor being connected, which fails the
+    // connect, under the lock the coroutine takes to replace or let go of that descriptor
+    struct Deadline{
+        std::mutex mutex{};
+        int fd = -1;
+        bool expired = false;
+    };
+    auto state = std::make_shared<Deadline>();
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(started + timeout - std::chrono::steady_clock::now());
+    if(timeout.count() > 0 && left.count() <= 0)
+        state->expired = true;
+    ScopedTimeout deadline(socket.get_io_service(), timeout.count() > 0 ? left : timeout, [state](){
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->expired = true;
+        if(state->fd >= 0)
+            ::shutdown(state->fd, SHUT_RDWR);
+    });
+    for(auto const & endpoint : endpoints){
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if(state->expired){
+                ec = boost::asio::error::timed_out;
+                break;
+            }
+            boost::system::error_code ignored;
+            socket.close(ignored);
+            socket.open(endpoint.protocol(), ec);
+            state->fd = ec ? -1 : socket.native_handle();
+        }
+        if(ec)
+            continue;
+        boost::system::error_code ignored;
+        profile.apply_before_connect(socket, ignored);
+        socket.async_connect(endpoint, yield[ec]);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if(state->expired)
+            ec = boost::asio::error::timed_out;
+        if(! ec){
+            state->fd = -1;
+            // the coroutine may have moved to another thread while waiting
+            Metrics::local().connect_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+            return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->fd = -1;
+    }
+    Metrics::local().error("connect", ec);
+    throw boost::system::system_error(ec);
+}
+
+inline boost::asio::ip::tcp::socket async_connect(boost::asio::io_service &io, boost::asio::yield_context yield, std::string host, std::string port, SocketProfile const & profile = SocketProfile{}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)){
+    boost::asio::ip::tcp::socket socket(io);
+    async_connect_socket(socket, yield, host, port, profile, timeout);
+    return socket;
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _SOCKET_PROFILE_H_
+#define _SOCKET_PROFILE_H_
+
+#include <map>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#if defined(__linux__) && ! defined(TCP_FASTOPEN_CONNECT)
+// linux 4.11, missing from older headers
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+/** Socket options of one side of the relay, every field left at 0 keeps the system default.
+ *  An option that fails (not supported here) is reported through ec, the others are still set. */
+struct SocketProfile{
+    bool nodelay = false;
+    int rcvbuf = 0;
+    int sndbuf = 0;
+    // listener: length of the TCP Fast Open queue, upstream: non zero sends data in the SYN
+    int fastopen = 0;
+    bool quickack = false;
+    // seconds, keepalive is turned on when keepalive_idle is set
+    int keepalive_idle = 0;
+    int keepalive_interval = 0;
+    int keepalive_count = 0;
+    int notsent_lowat = 0;
+    int mark = 0;
+    // listener only, 0 is SOMAXCONN
+    int backlog = 0;
+
+    template<int Level, int Name, typename Socket>
+    static void set(Socket & s, int value, boost::system::error_code & ec){
+        boost::system::error_code e;
+        s.set_option(boost::asio::detail::socket_option::integer<Level, Name>(value), e);
+        if(e && ! ec)
+            ec = e;
+    }
+    // options of a connected socket, or of one about to connect; ec is the first failure
+    void apply(boost::asio::ip::tcp::socket & s, boost::system::error_code & ec) const{
+        if(nodelay)
+            set<IPPROTO_TCP, TCP_NODELAY>(s, 1, ec);
+        apply_common(s, ec);
+        if(keepalive_idle > 0){
+            set<SOL_SOCKET, SO_KEEPALIVE>(s, 1, ec);
+#ifdef TCP_KEEPIDLE
+            set<IPPROTO_TCP, TCP_KEEPIDLE>(s, keepalive_idle, ec);
+#endif
+#ifdef TCP_KEEPINTVL
+            if(keepalive_interval > 0)
+                set<IPPROTO_TCP, TCP_KEEPINTVL>(s, keepalive_interval, ec);
+#endif
+#ifdef TCP_KEEPCNT
+            if(keepalive_count > 0)
+                set<IPPROTO_TCP, TCP_KEEPCNT>(s, keepalive_count, ec);
+#endif
+        }
+#ifdef TCP_QUICKACK
+        // not sticky, the kernel may go back to delayed acks later
+        if(quickack)
+            set<IPPROTO_TCP, TCP_QUICKACK>(s, 1, ec);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+        if(notsent_lowat > 0)
+            set<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(s, notsent_lowat, ec);
+#endif
+    }
+    // before connect: the options that must be set before the SYN, then the rest
+    void apply_before_connect(boost::asio::ip::tcp::socket & s, boost::system::error_code & ec) const{
+#ifdef TCP_FASTOPEN_CONNECT
+        if(fastopen > 0)
+            set<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(s, 1, ec);
+#endif
+        apply(s, ec);
+    }
+    // before listen
+    void apply_listener(boost::asio::ip::tcp::acceptor & a, boost::system::error_code & ec) const{
+        apply_common(a, ec);
+#ifdef TCP_FASTOPEN
+        if(fastopen > 0)
+            set<IPPROTO_TCP, TCP_FASTOPEN>(a, fastopen, ec);
+#endif
+    }
+    int listen_backlog() const{
+        return backlog > 0 ? backlog : boost::asio::socket_base::max_connections;
+    }
+private:
+    template<typename Socket>
+    void apply_common(Socket & s, boost::system::error_code & ec) const{
+        // buffers set before connect/listen so the window scale is chosen accordingly
+        if(rcvbuf > 0)
+            set<SOL_SOCKET, SO_RCVBUF>(s, rcvbuf, ec);
+        if(sndbuf > 0)
+            set<SOL_SOCKET, SO_SNDBUF>(s, sndbuf, ec);
+#ifdef SO_MARK
+        if(mark > 0)
+            set<SOL_SOCKET, SO_MARK>(s, mark, ec);
+#endif
+    }
+};
+
+/** Socket profiles read from the ini file given with --config:
+ *  [listen] for the listener and the accepted clients, [upstream] for the connects,
+ *  [upstream HOST:PORT] for the connects to one destination (on top of [upstream]). */
+struct SocketConfig{
+    SocketProfile listen{};
+    SocketProfile upstream{};
+    std::map<std::string, SocketProfile> upstreams{};
+
+    SocketProfile const & upstream_for(std::string const & host, std::string const & port) const{
+        auto iter = upstreams.find(host + ":" + port);
+        return iter == upstreams.end() ? upstream : iter->second;
+    }
+    static SocketProfile read_profile(boost::property_tree::ptree const & section, SocketProfile profile){
+        profile.nodelay = section.get<bool>("nodelay", profile.nodelay);
+        profile.rcvbuf = section.get<int>("rcvbuf", profile.rcvbuf);
+        profile.sndbuf = section.get<int>("sndbuf", profile.sndbuf);
+        profile.fastopen = section.get<int>("fastopen", profile.fastopen);
+        profile.quickack = section.get<bool>("quickack", profile.quickack);
+        profile.keepalive_idle = section.get<int>("keepalive_idle", profile.keepalive_idle);
+        profile.keepalive_interval = section.get<int>("keepalive_interval", profile.keepalive_interval);
+        profile.keepalive_count = section.get<int>("keepalive_count", profile.keepalive_count);
+        profile.notsent_lowat = section.get<int>("notsent_lowat", profile.notsent_lowat);
+        profile.mark = section.get<int>("mark", profile.mark);
+        profile.backlog = section.get<int>("backlog", profile.backlog);
+        return profile;
+    }
+    // throws boost::property_tree::ptree_error on a file that can not be read or a bad value
+    static SocketConfig load(std::string const & path){
+        boost::property_tree::ptree tree;
+        boost::property_tree::ini_parser::read_ini(path, tree);
+        SocketConfig config;
+        // sections are walked, not looked up: host names contain the path separator '.'
+        for(auto const & section : tree){
+            if(section.first == "listen"){
+                config.listen = read_profile(section.second, config.listen);
+            }else if(section.first == "upstream"){
+                config.upstream = read_profile(section.second, config.upstream);
+            }
+        }
+        for(auto const & section : tree){
+            if(section.first.compare(0, 9, "upstream ") == 0)
+                config.upstreams[section.first.substr(9)] = read_profile(section.second, config.upstream);
+        }
+        return config;
+    }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef _SOCKS5_H_
+#define _SOCKS5_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <boost/asio.hpp>
+
+/** SOCKS5 (RFC 1928, no authentication) handshake and UDP header parsing over whatever bytes have arrived.
+ *  Every parse function looks at data[0, size), returns incomplete until the whole message is
+ *  there and sets consumed, so a client pipelining greeting, request and payload in one segment
+ *  is handled from a single read. */
+namespace socks5{
+
+enum class Status{incomplete, ok, bad_version, no_acceptable_method, bad_command, bad_address_type};
+
+enum Command{command_connect = 0x01, command_bind = 0x02, command_udp_associate = 0x03};
+
+// REP field of a reply
+enum Reply{succeeded = 0x00, general_failure = 0x01, network_unreachable = 0x03, host_unreachable = 0x04,
+           connection_refused = 0x05, ttl_expired = 0x06, command_not_supported = 0x07, address_type_not_supported = 0x08};
+
+struct Request{
+    unsigned char command = 0;
+    // domain name or address literal
+    std::string host{};
+    unsigned short port = 0;
+};
+
+// longest greeting plus longest request
+static const std::size_t max_handshake = 2 + 255 + 4 + 1 + 255 + 2;
+
+inline Status parse_greeting(unsigned char const * data, std::size_t size, std::size_t & consumed){
+    if(size >= 1 && data[0] != 0x05)
+        return Status::bad_version;
+    if(size < 2 || size < 2 + std::size_t(data[1]))
+        return Status::incomplete;
+    consumed = 2 + data[1];
+    // only "no authentication"
+    if(std::find(data + 2, data + consumed, 0x00) == data + consumed)
+        return Status::no_acceptable_method;
+    return Status::ok;
+}
+
+// ATYP, DST.ADDR and DST.PORT at data: an address literal sets address, a domain name sets host
+inline Status parse_address(unsigned char const * data, std::size_t size, std::size_t & consumed, boost::asio::ip::address & address, std::string & host, unsigned short & port){
+    if(size < 1)
+        return Status::incomplete;
+    std::size_t address_size;
+    switch(data[0]){
+    case 0x01:
+        address_size = 4;
+        break;
+    case 0x03:
+        if(size < 2)
+            return Status::incomplete;
+        address_size = 1 + data[1];
+        break;
+    case 0x04:
+        address_size = 16;
+        break;
+    default:
+        return Status::bad_address_type;
+    }
+    if(size < 1 + address_size + 2)
+        return Status::incomplete;
+    auto bytes = data + 1;
+    if(data[0] == 0x01){
+        boost::asio::ip::address_v4::bytes_type v4;
+        std::copy(bytes, bytes + 4, v4.begin());
+        address = boost::asio::ip::address_v4(v4);
+    }else if(data[0] == 0x04){
+        boost::asio::ip::address_v6::bytes_type v6;
+        std::copy(bytes, bytes + 16, v6.begin());
+        address = boost::asio::ip::address_v6(v6);
+    }else{
+        host.assign(bytes + 1, bytes + address_size);
+    }
+    port = (bytes[address_size] << 8) | bytes[address_size + 1];
+    consumed = 1 + address_size + 2;
+    return Status::ok;
+}
+
+// bad_command and bad_address_type are known from the first 4 bytes, before the whole request is in
+inline Status parse_request(unsigned char const * data, std::size_t size, std::size_t & consumed, Request & request){
+    if(size >= 1 && data[0] != 0x05)
+        return Status::bad_version;
+    if(size < 4)
+        return Status::incomplete;
+    if(data[1] != command_connect && data[1] != command_bind && data[1] != command_udp_associate)
+        return Status::bad_command;
+    boost::asio::ip::address address;
+    std::string host;
+    unsigned short port;
+    std::size_t address_size;
+    auto status = parse_address(data + 3, size - 3, address_size, address, host, port);
+    if(status != Status::ok)
+        return status;
+    request.command = data[1];
+    request.host = data[3] == 0x03 ? host : address.to_string();
+    request.port = port;
+    consumed = 3 + address_size;
+    return Status::ok;
+}
+
+// ATYP, BND.ADDR and BND.PORT to out (at least 19 bytes), returns their size
+inline std::size_t write_address(unsigned char * out, boost::asio::ip::address const & address, unsigned short port){
+    std::size_t n = 0;
+    if(address.is_v6()){
+        out[n++] = 0x04;
+        auto bytes = address.to_v6().to_bytes();
+        n = std::copy(bytes.begin(), bytes.end(), out + n) - out;
+    }else{
+        out[n++] = 0x01;
+        auto bytes = address.is_v4() ? address.to_v4().to_bytes() : boost::asio::ip::address_v4::bytes_type{};
+        n = std::copy(bytes.begin(), bytes.end(), out + n) - out;
+    }
+    out[n++] = port >> 8;
+    out[n++] = port & 0xff;
+    return n;
+}
+
+// writes the reply carrying the bound address to out (at least 22 bytes), returns its size
+inline std::size_t write_reply(unsigned char * out, unsigned char reply, boost::asio::ip::address const & address, unsigned short port){
+    out[0] = 0x05;
+    out[1] = reply;
+    out[2] = 0x00;
+    return 3 + write_address(out + 3, address, port);
+}
+
+// the header in front of every datagram of a UDP association: RSV RSV FRAG, then the address.
+// fragment is FRAG, a relay not reassembling fragments drops the datagrams where it is not 0
+inline Status parse_udp_header(unsigned char const * data, std::size_t size, std::size_t & consumed, unsigned char & fragment, boost::asio::ip::address & address, std::string & host, unsigned short & port){
+    if(size < 3)
+        return Status::incomplete;
+    fragment = data[2];
+    std::size_t address_size;
+    auto status = parse_address(data + 3, size - 3, address_size, address, host, port);
+    if(status == Status::ok)
+        consumed = 3 + address_size;
+    return status;
+}
+
+inline std::size_t udp_header_size(boost::asio::ip::address const & address){
+    return address.is_v6() ? 3 + 1 + 16 + 2 : 3 + 1 + 4 + 2;
+}
+
+// to out (udp_header_size bytes), returns its size
+inline std::size_t write_udp_header(unsigned char * out, boost::asio::ip::address const & address, unsigned short port){
+    out[0] = 0x00;
+    out[1] = 0x00;
+    out[2] = 0x00;
+    return 3 + write_address(out + 3, address, port);
+}
+
+// the reply telling the client why the connect failed
+inline Reply reply_of(boost::system::error_code const & ec){
+    if(ec == boost::asio::error::connection_refused)
+        return connection_refused;
+    if(ec == boost::asio::error::network_unreachable)
+        return network_unreachable;
+    if(ec == boost::asio::error::host_unreachable || ec == boost::asio::error::host_not_found || ec == boost::asio::error::host_not_found_try_again)
+        return host_unreachable;
+    if(ec == boost::asio::error::timed_out)
+        return ttl_expired;
+    return general_failure;
+}
+
+}
+
+#endif
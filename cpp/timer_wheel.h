@@ -0,0 +1,147 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+
+/** Hashed timer wheel for the coarse timeouts of the relay (connect, handshake, idle), one per
+ *  io_service as an asio service: boost::asio::use_service<TimerWheel>(io).
+ *  Scheduling and cancelling are O(1), and a single deadline_timer ticks for all the timeouts,
+ *  only while some are pending. Callbacks run on the io_service. */
+class TimerWheel : public boost::asio::detail::service_base<TimerWheel>{
+public:
+    struct Entry{
+        // full turns of the wheel left before firing
+        std::size_t rounds = 0;
+        std::function<void()> callback{};
+        bool cancelled = false;
+    };
+    using Handle = std::shared_ptr<Entry>;
+    static const std::size_t num_of_slots = 512;
+    static const long resolution_ms = 100;
+private:
+    boost::asio::deadline_timer timer_;
+    std::mutex mutex_{};
+    std::array<std::vector<Handle>, num_of_slots> slots_{};
+    std::size_t cursor_ = 0;
+    std::size_t pending_ = 0;
+    bool ticking_ = false;
+    bool stopped_ = false;
+
+    // called locked
+    void tick_later(){
+        ticking_ = true;
+        timer_.expires_from_now(boost::posix_time::milliseconds(resolution_ms));
+        timer_.async_wait([this](boost::system::error_code const & ec){
+            if(! ec)
+                tick();
+        });
+    }
+    void tick(){
+        std::vector<Handle> due;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cursor_ = (cursor_ + 1) % num_of_slots;
+            auto & slot = slots_[cursor_];
+            for(std::size_t i = 0; i < slot.size();){
+                auto & entry = slot[i];
+                if(! entry->cancelled && entry->rounds > 0){
+                    --entry->rounds;
+                    ++i;
+                    continue;
+                }
+                if(! entry->cancelled)
+                    due.push_back(std::move(entry));
+                // order inside a slot does not matter
+                std::swap(entry, slot.back());
+                slot.pop_back();
+                --pending_;
+            }
+            if(pending_ > 0 && ! stopped_){
+                tick_later();
+            }else{
+                ticking_ = false;
+            }
+        }
+        for(auto & entry : due){
+            std::function<void()> callback;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(entry->cancelled)
+                    continue;
+                entry->cancelled = true;
+                std::swap(callback, entry->callback);
+            }
+            callback();
+        }
+    }
+    void shutdown_service(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        for(auto & slot : slots_){
+            slot.clear();
+        }
+        pending_ = 0;
+    }
+public:
+    explicit TimerWheel(boost::asio::io_service & io):boost::asio::detail::service_base<TimerWheel>(io), timer_(io){
+    }
+    // callback runs once, after about `after` (rounded up to the resolution) unless cancelled first
+    Handle schedule(std::chrono::milliseconds after, std::function<void()> callback){
+        auto ticks = std::max<long long>(1, (after.count() + resolution_ms - 1) / resolution_ms);
+        auto entry = std::make_shared<Entry>();
+        entry->rounds = (ticks - 1) / num_of_slots;
+        entry->callback = std::move(callback);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(stopped_)
+            return entry;
+        slots_[(cursor_ + ticks) % num_of_slots].push_back(entry);
+        ++pending_;
+        if(! ticking_)
+            tick_later();
+        return entry;
+    }
+    // the callback is released at once, the entry leaves the wheel when its slot comes up
+    void cancel(Handle const & entry){
+        if(! entry)
+            return;
+        std::function<void()> callback;
+        std::lock_guard<std::mutex> lock(mutex_);
+        entry->cancelled = true;
+        std::swap(callback, entry->callback);
+    }
+};
+
+/** A TimerWheel timeout cancelled when leaving the scope. */
+class ScopedTimeout{
+    TimerWheel * wheel_ = nullptr;
+    TimerWheel::Handle handle_{};
+public:
+    ScopedTimeout() = default;
+    // no timeout when after is 0
+    ScopedTimeout(boost::asio::io_service & io, std::chrono::milliseconds after, std::function<void()> callback){
+        if(after.count() > 0){
+            wheel_ = &boost::asio::use_service<TimerWheel>(io);
+            handle_ = wheel_->schedule(after, std::move(callback));
+        }
+    }
+    ScopedTimeout(ScopedTimeout const &) = delete;
+    ScopedTimeout & operator=(ScopedTimeout const &) = delete;
+    ~ScopedTimeout(){
+        cancel();
+    }
+    void cancel(){
+        if(wheel_)
+            wheel_->cancel(handle_);
+        wheel_ = nullptr;
+        handle_.reset();
+    }
+};
+
+#endif
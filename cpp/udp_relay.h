@@ -0,0 +1,315 @@
+#ifndef _UDP_RELAY_H_
+#define _UDP_RELAY_H_
+
+#ifdef __linux__
+#include <array>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "metrics.h"
+#include "resolver_cache.h"
+#include "socks5.h"
+
+/** Datagrams moved by one recvmmsg(2) or sendmmsg(2). A scratch area per thread, filled and
+ *  drained within one handler; the data pages are only touched as datagrams come in. */
+class DatagramBatch{
+public:
+    static const std::size_t size = 32;
+    // room in front of every datagram for the SOCKS5 header put on it, IPv6 being the largest
+    static const std::size_t headroom = 24;
+    static const std::size_t capacity = 65536;
+    std::array<mmsghdr, size> messages{};
+    std::array<iovec, size> iov{};
+    std::array<sockaddr_storage, size> addresses{};
+private:
+    std::unique_ptr<char[]> data_{new char[size * (headroom + capacity)]};
+public:
+    static DatagramBatch & local(){
+        static thread_local DatagramBatch batch;
+        return batch;
+    }
+    char * data(std::size_t i){
+        return data_.get() + i * (headroom + capacity) + headroom;
+    }
+    // up to size datagrams into data(i), without waiting; 0 with ec clear when none is ready
+    std::size_t receive(int fd, boost::system::error_code & ec){
+        for(std::size_t i = 0; i < size; ++i){
+            iov[i].iov_base = data(i);
+            iov[i].iov_len = capacity;
+            std::memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        }
+        while(true){
+            auto n = ::recvmmsg(fd, messages.data(), size, MSG_DONTWAIT, nullptr);
+            if(n >= 0)
+                return n;
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                ec = boost::system::error_code(errno, boost::system::system_category());
+            return 0;
+        }
+    }
+    // messages[0, n) as set up by the caller; a datagram the kernel refuses is skipped and what
+    // does not fit in the socket buffer is dropped, as a router would. Returns how many went out,
+    // bytes is their size
+    std::size_t send(int fd, std::size_t n, std::size_t & bytes, boost::system::error_code & ec){
+        std::size_t sent = 0;
+        bytes = 0;
+        for(std::size_t i = 0; i < n;){
+            auto m = ::sendmmsg(fd, &messages[i], n - i, MSG_DONTWAIT);
+            if(m > 0){
+                for(auto end = i + m; i < end; ++i){
+                    bytes += messages[i].msg_len;
+                }
+                sent += m;
+                continue;
+            }
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            // refused (unreachable, too big), the next ones may still go
+            ++i;
+        }
+        return sent;
+    }
+};
+
+/** The relay of one SOCKS5 UDP ASSOCIATE (RFC 1928 section 7), alive as long as its control
+ *  connection. Datagrams of the client arrive on a socket of their own, lose their SOCKS5 header
+ *  and leave through a second socket towards their destinations; the answers come back on that
+ *  one, get the header of their source and go to the client. Both ways move up to
+ *  DatagramBatch::size datagrams per system call. */
+class UdpAssociation : public std::enable_shared_from_this<UdpAssociation>{
+public:
+    using udp = boost::asio::ip::udp;
+    // names kept resolved per association, and datagrams held while one is looked up
+    static const std::size_t max_names = 256;
+    static const std::size_t max_waiting = 8;
+
+    // client: where the client sends from, port 0 when it did not say. local: the address the
+    // client reached the server on
+    UdpAssociation(boost::asio::io_service & io, boost::asio::ip::address const & local, udp::endpoint const & client)
+        : strand_(io), client_socket_(io, udp::endpoint(unmapped(local), 0)), upstream_socket_(io), client_(unmapped(client.address()), client.port()){
+        boost::system::error_code ec;
+        upstream_socket_.open(udp::v6(), ec);
+        if(! ec){
+            // one socket for both families, IPv4 destinations as mapped addresses
+            upstream_socket_.set_option(boost::asio::ip::v6_only(false), ec);
+            if(! ec)
+                upstream_socket_.bind(udp::endpoint(boost::asio::ip::address_v6::any(), 0), ec);
+            if(ec)
+                upstream_socket_.close();
+        }
+        if(ec){
+            upstream_socket_.open(udp::v4());
+            upstream_socket_.bind(udp::endpoint(boost::asio::ip::address_v4::any(), 0));
+        }else{
+            dual_stack_ = true;
+        }
+        client_socket_.non_blocking(true);
+        upstream_socket_.non_blocking(true);
+    }
+    // the BND.ADDR and BND.PORT of the reply
+    udp::endpoint local_endpoint() const{
+        return client_socket_.local_endpoint();
+    }
+    void start(){
+        wait_client();
+        wait_upstream();
+    }
+    void close(){
+        auto self = shared_from_this();
+        strand_.dispatch([self](){
+            boost::system::error_code ignored;
+            self->client_socket_.close(ignored);
+            self->upstream_socket_.close(ignored);
+        });
+    }
+private:
+    boost::asio::io_service::strand strand_;
+    udp::socket client_socket_;
+    udp::socket upstream_socket_;
+    // upstream_socket_ is IPv6 and takes both families
+    bool dual_stack_ = false;
+    udp::endpoint client_;
+    std::unordered_map<std::string, udp::endpoint> names_{};
+    // "host:port" being looked up -> payloads to send once it is known
+    std::unordered_map<std::string, std::vector<std::string>> waiting_{};
+
+    static boost::asio::ip::address unmapped(boost::asio::ip::address const & address){
+        if(address.is_v6() && address.to_v6().is_v4_mapped())
+            return address.to_v6().to_v4();
+        return address;
+    }
+    // the address as the upstream socket takes it
+    udp::endpoint upstream_endpoint(boost::asio::ip::address const & address, unsigned short port) const{
+        if(address.is_v4() && dual_stack_)
+            return udp::endpoint(boost::asio::ip::address_v6::v4_mapped(address.to_v4()), port);
+        return udp::endpoint(address, port);
+    }
+    static udp::endpoint endpoint_of(sockaddr_storage const & address, socklen_t length){
+        udp::endpoint endpoint;
+        std::memcpy(endpoint.data(), &address, std::min<std::size_t>(length, endpoint.capacity()));
+        endpoint.resize(std::min<std::size_t>(length, endpoint.capacity()));
+        return endpoint;
+    }
+    // datagrams from anywhere else are dropped; the port is the one of the request, or of the
+    // first datagram when the request left it 0
+    bool from_client(udp::endpoint const & source){
+        if(unmapped(source.address()) != client_.address())
+            return false;
+        if(client_.port() == 0)
+            client_.port(source.port());
+        return source.port() == client_.port();
+    }
+    void wait_client(){
+        auto self = shared_from_this();
+        client_socket_.async_receive(boost::asio::null_buffers(), strand_.wrap([self](boost::system::error_code const & ec, std::size_t){
+            if(ec)
+                return;
+            self->relay_from_client();
+            self->wait_client();
+        }));
+    }
+    void wait_upstream(){
+        auto self = shared_from_this();
+        upstream_socket_.async_receive(boost::asio::null_buffers(), strand_.wrap([self](boost::system::error_code const & ec, std::size_t){
+            if(ec)
+                return;
+            self->relay_from_upstream();
+            self->wait_upstream();
+        }));
+    }
+    void relay_from_client(){
+        auto & batch = DatagramBatch::local();
+        boost::system::error_code ec;
+        auto n = batch.receive(client_socket_.native_handle(), ec);
+        // datagrams to send are compacted to the front of the batch, in place
+        std::size_t out = 0;
+        for(std::size_t i = 0; i < n; ++i){
+            auto & message = batch.messages[i];
+            if(! from_client(endpoint_of(batch.addresses[i], message.msg_hdr.msg_namelen)))
+                continue;
+            auto data = reinterpret_cast<unsigned char *>(batch.data(i));
+            std::size_t consumed;
+            unsigned char fragment;
+            boost::asio::ip::address address;
+            std::string host;
+            unsigned short port;
+            if(socks5::parse_udp_header(data, message.msg_len, consumed, fragment, address, host, port) != socks5::Status::ok || fragment != 0)
+                continue;
+            udp::endpoint destination;
+            if(host.empty()){
+                destination = upstream_endpoint(address, port);
+            }else{
+                auto key = host + ":" + std::to_string(port);
+                auto iter = names_.find(key);
+                if(iter == names_.end()){
+                    wait_for_name(key, host, port, std::string(reinterpret_cast<char *>(data) + consumed, message.msg_len - consumed));
+                    continue;
+                }
+                destination = iter->second;
+            }
+            if(destination.address().is_v6() && ! dual_stack_)
+                continue;
+            std::memcpy(&batch.addresses[out], destination.data(), destination.size());
+            batch.iov[out].iov_base = data + consumed;
+            batch.iov[out].iov_len = message.msg_len - consumed;
+            auto & send = batch.messages[out];
+            std::memset(&send, 0, sizeof(send));
+            send.msg_hdr.msg_name = &batch.addresses[out];
+            send.msg_hdr.msg_namelen = destination.size();
+            send.msg_hdr.msg_iov = &batch.iov[out];
+            send.msg_hdr.msg_iovlen = 1;
+            ++out;
+        }
+        if(out > 0){
+            std::size_t bytes;
+            auto sent = batch.send(upstream_socket_.native_handle(), out, bytes, ec);
+            Metrics::local().add_datagrams(ThreadMetrics::client_to_upstream, sent, bytes);
+        }
+        if(ec)
+            Metrics::local().error("udp", ec);
+    }
+    void relay_from_upstream(){
+        auto & batch = DatagramBatch::local();
+        boost::system::error_code ec;
+        auto n = batch.receive(upstream_socket_.native_handle(), ec);
+        // nowhere to send them before the client's first datagram
+        if(client_.port() == 0)
+            return;
+        for(std::size_t i = 0; i < n; ++i){
+            auto & message = batch.messages[i];
+            auto source = endpoint_of(batch.addresses[i], message.msg_hdr.msg_namelen);
+            auto address = unmapped(source.address());
+            auto length = message.msg_len;
+            // the header goes in the headroom, right in front of the payload
+            auto header = reinterpret_cast<unsigned char *>(batch.data(i)) - socks5::udp_header_size(address);
+            socks5::write_udp_header(header, address, source.port());
+            batch.iov[i].iov_base = header;
+            batch.iov[i].iov_len = socks5::udp_header_size(address) + length;
+            std::memcpy(&batch.addresses[i], client_.data(), client_.size());
+            message.msg_hdr.msg_namelen = client_.size();
+        }
+        if(n > 0){
+            std::size_t bytes;
+            auto sent = batch.send(client_socket_.native_handle(), n, bytes, ec);
+            Metrics::local().add_datagrams(ThreadMetrics::upstream_to_client, sent, bytes);
+        }
+        if(ec)
+            Metrics::local().error("udp", ec);
+    }
+    // names are looked up once per association, the datagrams in the meantime wait (a few of them)
+    void wait_for_name(std::string const & key, std::string const & host, unsigned short port, std::string payload){
+        auto iter = waiting_.find(key);
+        if(iter != waiting_.end()){
+            if(iter->second.size() < max_waiting)
+                iter->second.push_back(std::move(payload));
+            return;
+        }
+        waiting_[key].push_back(std::move(payload));
+        auto self = shared_from_this();
+        boost::asio::spawn(strand_, [self, key, host, port](boost::asio::yield_context yield){
+            udp::endpoint destination;
+            try{
+                auto endpoints = ResolverCache::instance().resolve(self->client_socket_.get_io_service(), yield, host, std::to_string(port));
+                for(auto const & endpoint : endpoints){
+                    if(endpoint.address().is_v4() || self->dual_stack_){
+                        destination = self->upstream_endpoint(endpoint.address(), endpoint.port());
+                        break;
+                    }
+                }
+            }catch(boost::system::system_error const &){
+                // counted by the cache
+            }
+            auto payloads = std::move(self->waiting_[key]);
+            self->waiting_.erase(key);
+            if(destination.port() == 0)
+                return;
+            if(self->names_.size() >= max_names)
+                self->names_.clear();
+            self->names_[key] = destination;
+            for(auto const & payload : payloads){
+                boost::system::error_code ec;
+                self->upstream_socket_.send_to(boost::asio::buffer(payload), destination, 0, ec);
+                if(! ec)
+                    Metrics::local().add_datagrams(ThreadMetrics::client_to_upstream, 1, payload.size());
+            }
+        });
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef _UPSTREAM_GROUP_H_
+#define _UPSTREAM_GROUP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include "resolver_cache.h"
+
+/** The destinations of an AcceptServer, shared by all the shards.
+ *  Health is tracked passively (failed connects) and optionally actively (periodic probe connects);
+ *  a backend that is down is skipped until it comes back. */
+class UpstreamGroup{
+public:
+    enum class Policy{round_robin, least_conn, hash};
+    struct Backend{
+        std::string host;
+        std::string port;
+        // options of the connects to this backend
+        SocketProfile profile{};
+        // consecutive failed connects
+        std::atomic<int> failures{0};
+        // steady_clock ticks, out of rotation until then
+        std::atomic<long long> down_until{0};
+        Backend(std::string const & host, std::string const & port):host(host), port(port){
+        }
+    };
+private:
+    using clock = std::chrono::steady_clock;
+    std::vector<std::unique_ptr<Backend>> backends_{};
+    Policy policy_;
+    int max_fails_;
+    std::chrono::seconds fail_timeout_;
+    // consistent hashing ring, (point, backend index) sorted by point
+    std::vector<std::pair<std::size_t, std::size_t>> ring_{};
+    std::once_flag health_checks_started_{};
+    static const int virtual_nodes = 100;
+
+    static long long ticks(clock::time_point time){
+        return time.time_since_epoch().count();
+    }
+    void probe(boost::asio::io_service & io, std::size_t index, std::chrono::seconds interval){
+        boost::asio::spawn(io, [this, &io, index, interval](boost::asio::yield_context yield){
+            auto & backend = *backends_[index];
+            // the probe gives up after one interval
+            boost::asio::ip::tcp::socket s(io);
+            try{
+                async_connect_socket(s, yield, backend.host, backend.port, backend.profile, interval);
+                report_success(index);
+            }catch(boost::system::system_error const & e){
+                if(available(index))
+                    std::cerr << "UpstreamGroup: " << backend.host << ":" << backend.port << " is down, " << e.what() << "\n";
+                // stays out until a later probe succeeds
+                backend.down_until.store(ticks(clock::now() + interval * 2), std::memory_order_relaxed);
+            }
+        });
+    }
+    void health_check_loop(boost::asio::io_service & io, std::chrono::seconds interval){
+        auto timer = std::make_shared<boost::asio::deadline_timer>(io);
+        auto tick = std::make_shared<std::function<void()>>();
+        *tick = [this, &io, interval, timer, tick](){
+            for(std::size_t i = 0; i < backends_.size(); ++i){
+                probe(io, i, interval);
+            }
+            timer->expires_from_now(boost::posix_time::seconds(interval.count()));
+            timer->async_wait([tick](boost::system::error_code const & ec){
+                if(! ec)
+                    (*tick)();
+            });
+        };
+        io.post([tick](){
+            (*tick)();
+        });
+    }
+public:
+    UpstreamGroup(std::vector<std::pair<std::string, std::string>> const & destinations, Policy policy, int max_fails = 2, std::chrono::seconds fail_timeout = std::chrono::seconds(10))
+        : policy_(policy), max_fails_(max_fails), fail_timeout_(fail_timeout){
+        for(auto const & destination : destinations){
+            backends_.emplace_back(new Backend(destination.first, destination.second));
+        }
+        for(std::size_t i = 0; i < backends_.size(); ++i){
+            for(auto v = 0; v < virtual_nodes; ++v){
+                auto key = backends_[i]->host + ":" + backends_[i]->port + "#" + std::to_string(v);
+                ring_.emplace_back(std::hash<std::string>()(key), i);
+            }
+        }
+        std::sort(ring_.begin(), ring_.end());
+    }
+    UpstreamGroup(UpstreamGroup const &) = delete;
+    UpstreamGroup & operator=(UpstreamGroup const &) = delete;
+
+    std::size_t size() const{
+        return backends_.size();
+    }
+    Policy policy() const{
+        return policy_;
+    }
+    Backend & backend(std::size_t index){
+        return *backends_[index];
+    }
+    bool available(std::size_t index) const{
+        return ticks(clock::now()) >= backends_[index]->down_until.load(std::memory_order_relaxed);
+    }
+    void report_success(std::size_t index){
+        auto & backend = *backends_[index];
+        backend.failures.store(0, std::memory_order_relaxed);
+        backend.down_until.store(0, std::memory_order_relaxed);
+    }
+    void report_failure(std::size_t index){
+        auto & backend = *backends_[index];
+        if(backend.failures.fetch_add(1, std::memory_order_relaxed) + 1 >= max_fails_){
+            backend.failures.store(0, std::memory_order_relaxed);
+            backend.down_until.store(ticks(clock::now() + fail_timeout_), std::memory_order_relaxed);
+            std::cerr << "UpstreamGroup: " << backend.host << ":" << backend.port << " out of rotation for " << fail_timeout_.count() << "s\n";
+        }
+    }
+    // first backend on the ring at or after hash that passes ok
+    std::size_t ring_lookup(std::size_t hash, std::function<bool(std::size_t)> const & ok) const{
+        auto iter = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(hash, std::size_t(0)));
+        for(std::size_t n = 0; n < ring_.size(); ++n, ++iter){
+            if(iter == ring_.end())
+                iter = ring_.begin();
+            if(ok(iter->second))
+                return iter->second;
+        }
+        return size();
+    }
+    // probes run on the io_service of the first caller, later calls do nothing
+    void start_health_checks(boost::asio::io_service & io, std::chrono::seconds interval){
+        if(interval.count() <= 0)
+            return;
+        std::call_once(health_checks_started_, [this, &io, interval](){
+            health_check_loop(io, interval);
+        });
+    }
+};
+
+/** One shard's view of an UpstreamGroup. The round robin position and the connection counts
+ *  are per shard, so picking a backend takes no global lock. */
+class Balancer{
+    std::shared_ptr<UpstreamGroup> group_;
+    // shared with the release functions of the open connections, which may outlive the shard
+    std::shared_ptr<std::vector<std::atomic<long>>> active_;
+    // shared by the threads of the shared io_service fallback
+    std::atomic<std::size_t> next_{0};
+
+    // index of the backend to use, or group size when nothing is left.
+    // the first pass skips backends that are down, the second one takes them anyway
+    std::size_t pick_pass(boost::asio::ip::address const & client, std::vector<bool> const & tried, bool healthy_only){
+        auto & group = *group_;
+        auto ok = [&](std::size_t i){
+            return ! tried[i] && (! healthy_only || group.available(i));
+        };
+        auto n = group.size();
+        switch(group.policy()){
+        case UpstreamGroup::Policy::hash:
+            return group.ring_lookup(std::hash<std::string>()(client.to_string()), ok);
+        case UpstreamGroup::Policy::least_conn:{
+            auto best = n;
+            // rotate the start so ties are spread
+            auto start = next_.fetch_add(1, std::memory_order_relaxed);
+            for(std::size_t k = 0; k < n; ++k){
+                auto i = (start + k) % n;
+                if(ok(i) && (best == n || (*active_)[i].load(std::memory_order_relaxed) < (*active_)[best].load(std::memory_order_relaxed)))
+                    best = i;
+            }
+            return best;
+        }
+        default:
+            for(std::size_t k = 0; k < n; ++k){
+                auto i = next_.fetch_add(1, std::memory_order_relaxed) % n;
+                if(ok(i))
+                    return i;
+            }
+            return n;
+        }
+    }
+public:
+    explicit Balancer(std::shared_ptr<UpstreamGroup> group):group_(std::move(group)), active_(std::make_shared<std::vector<std::atomic<long>>>(group_->size())){
+        for(auto & active : *active_){
+            active.store(0, std::memory_order_relaxed);
+        }
+    }
+    UpstreamGroup & group(){
+        return *group_;
+    }
+    std::size_t pick(boost::asio::ip::address const & client, std::vector<bool> const & tried){
+        auto index = pick_pass(client, tried, true);
+        if(index == group_->size())
+            index = pick_pass(client, tried, false);
+        return index;
+    }
+    // counts a connection to index until the returned function is called
+    std::function<void()> acquire(std::size_t index){
+        (*active_)[index].fetch_add(1, std::memory_order_relaxed);
+        auto active = active_;
+        return [active, index](){
+            (*active)[index].fetch_sub(1, std::memory_order_relaxed);
+        };
+    }
+};
+
+#endif
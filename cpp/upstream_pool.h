@@ -0,0 +1,134 @@
+#ifndef _UPSTREAM_POOL_H_
+#define _UPSTREAM_POOL_H_
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <sys/socket.h>
+#include "resolver_cache.h"
+
+/** Established connections to one destination, kept ready so an accepted client does not wait
+ *  for the upstream handshake. Refilled in the background, checked for liveness when taken and
+ *  dropped after max_idle. */
+class UpstreamPool{
+    using socket = boost::asio::ip::tcp::socket;
+    using clock = std::chrono::steady_clock;
+    struct Idle{
+        socket s;
+        clock::time_point since;
+    };
+    boost::asio::io_service & io_;
+    std::string host_;
+    std::string port_;
+    std::size_t size_;
+    std::chrono::seconds max_idle_;
+    SocketProfile profile_;
+    std::chrono::milliseconds connect_timeout_;
+    std::mutex mutex_{};
+    std::deque<Idle> idle_{};
+    std::size_t connecting_ = 0;
+    boost::asio::deadline_timer sweep_timer_;
+    boost::asio::deadline_timer retry_timer_;
+    bool retry_pending_ = false;
+
+    // the peer has not closed nor reset the connection while it sat in the pool.
+    // bytes waiting (a server greeting) are fine, they are relayed as usual
+    static bool alive(socket & s){
+        char c;
+        auto n = ::recv(s.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(n > 0)
+            return true;
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    void connect_one(){
+        boost::asio::spawn(io_, [this](boost::asio::yield_context yield){
+            socket s(io_);
+            auto ok = false;
+            try{
+                s = async_connect(io_, yield, host_, port_, profile_, connect_timeout_);
+                ok = true;
+            }catch(boost::system::system_error const & e){
+                std::cerr << "UpstreamPool: failed to connect " << host_ << ":" << port_ << " " << e.what() << "\n";
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            --connecting_;
+            if(ok){
+                idle_.push_back(Idle{std::move(s), clock::now()});
+            }else if(! retry_pending_){
+                // do not hammer a dead destination, try again later
+                retry_pending_ = true;
+                retry_timer_.expires_from_now(boost::posix_time::seconds(1));
+                retry_timer_.async_wait([this](boost::system::error_code const &){
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    retry_pending_ = false;
+                    fill();
+                });
+            }
+        });
+    }
+    // called locked
+    void fill(){
+        while(! retry_pending_ && idle_.size() + connecting_ < size_){
+            ++connecting_;
+            connect_one();
+        }
+    }
+    void sweep(){
+        auto period = std::max<long>(max_idle_.count() / 2, 1);
+        sweep_timer_.expires_from_now(boost::posix_time::seconds(period));
+        sweep_timer_.async_wait([this](boost::system::error_code const & ec){
+            if(ec)
+                return;
+            std::deque<Idle> expired;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto deadline = clock::now() - max_idle_;
+                for(auto iter = idle_.begin(); iter != idle_.end();){
+                    if(iter->since < deadline || ! alive(iter->s)){
+                        expired.push_back(std::move(*iter));
+                        iter = idle_.erase(iter);
+                    }else{
+                        ++iter;
+                    }
+                }
+                fill();
+            }
+            sweep();
+        });
+    }
+public:
+    UpstreamPool(boost::asio::io_service & io, std::string const & host, std::string const & port, std::size_t size, std::chrono::seconds max_idle, SocketProfile const & profile = SocketProfile{}, std::chrono::milliseconds connect_timeout = std::chrono::milliseconds(0))
+        : io_(io), host_(host), port_(port), size_(size), max_idle_(max_idle), profile_(profile), connect_timeout_(connect_timeout), sweep_timer_(io), retry_timer_(io){
+    }
+    UpstreamPool(UpstreamPool const &) = delete;
+    UpstreamPool & operator=(UpstreamPool const &) = delete;
+
+    void start(){
+        io_.post([this](){
+            std::lock_guard<std::mutex> lock(mutex_);
+            fill();
+        });
+        sweep();
+    }
+    // true with a live connection moved into out, false when none is ready
+    bool take(socket & out){
+        std::lock_guard<std::mutex> lock(mutex_);
+        while(! idle_.empty()){
+            auto idle = std::move(idle_.front());
+            idle_.pop_front();
+            if(clock::now() - idle.since < max_idle_ && alive(idle.s)){
+                out = std::move(idle.s);
+                fill();
+                return true;
+            }
+        }
+        fill();
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,641 @@
+#ifndef _URING_RELAY_H_
+#define _URING_RELAY_H_
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// multishot receive (linux 6.0) and provided buffer rings (5.19) are needed, older headers
+// build without the io_uring relay
+#ifdef IORING_RECV_MULTISHOT
+#define PORT_FORWARD_HAS_IO_URING 1
+#else
+#define PORT_FORWARD_HAS_IO_URING 0
+#endif
+
+#if PORT_FORWARD_HAS_IO_URING
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include "buffer_pool.h"
+#include "metrics.h"
+
+/** Submission and completion rings of one io_uring instance, set up with the raw system calls. */
+class IoUring{
+    int fd_ = -1;
+    void * sq_ring_ = MAP_FAILED;
+    std::size_t sq_ring_size_ = 0;
+    void * cq_ring_ = MAP_FAILED;
+    std::size_t cq_ring_size_ = 0;
+    io_uring_sqe * sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t sqes_size_ = 0;
+    unsigned * sq_head_ = nullptr;
+    unsigned * sq_tail_ = nullptr;
+    unsigned * sq_flags_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned * cq_head_ = nullptr;
+    unsigned * cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe * cqes_ = nullptr;
+    // sqes queued since the last io_uring_enter
+    unsigned to_submit_ = 0;
+
+    static boost::system::error_code last_error(){
+        return boost::system::error_code(errno, boost::system::system_category());
+    }
+    template<typename T>
+    T * at(void * ring, unsigned offset){
+        return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+    }
+public:
+    IoUring() = default;
+    IoUring(IoUring const &) = delete;
+    IoUring & operator=(IoUring const &) = delete;
+    ~IoUring(){
+        if(sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqes_size_);
+        if(cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            ::munmap(cq_ring_, cq_ring_size_);
+        if(sq_ring_ != MAP_FAILED)
+            ::munmap(sq_ring_, sq_ring_size_);
+        if(fd_ >= 0)
+            ::close(fd_);
+    }
+    // fails when the kernel has no io_uring or it is not allowed here (seccomp, io_uring_disabled)
+    bool open(unsigned entries, boost::system::error_code & ec){
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        // completions are not dropped while the consumer lags, see submit()
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+        if(fd_ < 0){
+            ec = last_error();
+            return false;
+        }
+        if(! (params.features & IORING_FEAT_NODROP)){
+            ec = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+            return false;
+        }
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if(params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if(sq_ring_ == MAP_FAILED){
+            ec = last_error();
+            return false;
+        }
+        if(params.features & IORING_FEAT_SINGLE_MMAP){
+            cq_ring_ = sq_ring_;
+        }else{
+            cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if(cq_ring_ == MAP_FAILED){
+                ec = last_error();
+                return false;
+            }
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if(sqes_ == MAP_FAILED){
+            ec = last_error();
+            return false;
+        }
+        sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+        sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+        sq_flags_ = at<unsigned>(sq_ring_, params.sq_off.flags);
+        sq_mask_ = *at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        // sqe i always sits in slot i
+        auto array = at<unsigned>(sq_ring_, params.sq_off.array);
+        for(unsigned i = 0; i < sq_entries_; ++i){
+            array[i] = i;
+        }
+        cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+        cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+        cq_mask_ = *at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+        cqes_ = at<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+        return true;
+    }
+    int fd() const{
+        return fd_;
+    }
+    int register_resource(unsigned opcode, void * arg, unsigned count){
+        return ::syscall(__NR_io_uring_register, fd_, opcode, arg, count);
+    }
+    // a zeroed sqe, handed to the kernel by the next submit(); the queued ones are submitted
+    // first when the ring is full, null when that does not free a slot either
+    io_uring_sqe * get_sqe(){
+        auto tail = *sq_tail_;
+        if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_){
+            submit();
+            if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+                return nullptr;
+        }
+        auto sqe = &sqes_[tail & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+        return sqe;
+    }
+    bool pending() const{
+        return to_submit_ > 0;
+    }
+    // one io_uring_enter for everything queued; it also moves completions that overflowed the
+    // completion ring back in
+    void submit(){
+        unsigned flags = 0;
+        if(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+            flags |= IORING_ENTER_GETEVENTS;
+        if(to_submit_ == 0 && flags == 0)
+            return;
+        auto n = ::syscall(__NR_io_uring_enter, fd_, to_submit_, 0, flags, nullptr, 0);
+        // EBUSY/EAGAIN: the kernel is short of room, what is left goes with the next submit
+        if(n > 0)
+            to_submit_ -= std::min<unsigned>(to_submit_, n);
+    }
+    // calls f(cqe) for every completion ready, returns how many
+    template<typename F>
+    unsigned reap(F && f){
+        unsigned count = 0;
+        auto head = *cq_head_;
+        while(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)){
+            auto cqe = cqes_[head & cq_mask_];
+            ++head;
+            // the slot is free again before f submits more
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            f(cqe);
+            ++count;
+        }
+        return count;
+    }
+};
+
+/** Relay engine on io_uring, one per io_service as an asio service: boost::asio::use_service<UringRelay>(io).
+ *  A direction is a multishot receive on the source into the buffers of a ring registered with
+ *  the kernel, and sendmsg(2) of what arrived to the destination, up to 16 buffers at a time.
+ *  All the submissions queued while handling completions go to the kernel in one io_uring_enter,
+ *  and the completions wake the io_service through an eventfd, so one wakeup and one system
+ *  call move data for many connections. The io_service must be run by a single thread. */
+class UringRelay : public boost::asio::detail::service_base<UringRelay>{
+public:
+    // called with the end of the direction: eof, or the error that ended it
+    using Handler = std::function<void(boost::system::error_code, std::size_t)>;
+    // sees every chunk received, before it is sent
+    using Observer = std::function<void(boost::asio::const_buffer)>;
+    static const unsigned num_of_entries = 256;
+    static const unsigned num_of_buffers = 512;
+    static const std::size_t buffer_size = 16 * 1024;
+    // buffers a direction may hold received ahead of its sends: few enough that the directions
+    // stalled on a slow peer leave most of the ring to the others
+    static const std::size_t stream_buffers = 4;
+    static const std::size_t max_gather = 16;
+    static const unsigned short buffer_group = 0;
+private:
+    enum Operation : std::uint64_t{op_cancel = 0, op_recv = 1, op_send = 2};
+    static const unsigned short no_buffer = 0xffff;
+    struct Chunk{
+        // no_buffer once copied out of the ring
+        unsigned short id;
+        std::size_t size;
+        std::unique_ptr<char[]> copy;
+
+        Chunk(unsigned short id, std::size_t size) : id(id), size(size), copy(){
+        }
+    };
+    struct Stream{
+        int src;
+        int dst;
+        ThreadMetrics::Direction direction;
+        Observer observer;
+        Handler handler;
+        // buffer id and bytes received, the front one may be partly sent already
+        std::deque<Chunk> chunks{};
+        std::size_t sent = 0;
+        std::array<iovec, max_gather> iov{};
+        msghdr message{};
+        bool receiving = false;
+        bool cancelling = false;
+        bool sending = false;
+        bool eof = false;
+        // waiting for buffers to come back to the ring
+        bool starved = false;
+        bool done = false;
+
+        Stream(int src, int dst, ThreadMetrics::Direction direction, Observer observer, Handler handler)
+            : src(src), dst(dst), direction(direction), observer(std::move(observer)), handler(std::move(handler)){
+        }
+    };
+
+    // anonymous memory shared with the kernel, unmapped after the ring is closed
+    struct Mapping{
+        void * data = MAP_FAILED;
+        std::size_t size = 0;
+        ~Mapping(){
+            if(data != MAP_FAILED)
+                ::munmap(data, size);
+        }
+        bool map(std::size_t bytes){
+            size = bytes;
+            data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            return data != MAP_FAILED;
+        }
+    };
+
+    boost::asio::io_service & io_;
+    Mapping buffer_ring_memory_{};
+    Mapping buffer_memory_{};
+    IoUring ring_{};
+    boost::system::error_code error_{};
+    int event_fd_ = -1;
+    boost::asio::posix::stream_descriptor event_;
+    // the ring as an array: io_uring_buf_ring declares its entries in a way that shifts them by
+    // 8 bytes when compiled as C++. The tail overlays the resv field of entry 0
+    io_uring_buf * buffer_ring_ = nullptr;
+    char * buffers_ = nullptr;
+    unsigned short buffer_tail_ = 0;
+    // in the ring, for the kernel to pick
+    std::size_t free_buffers_ = 0;
+    std::unordered_map<Stream *, std::unique_ptr<Stream>> streams_{};
+    // waiting for buffers, served oldest first
+    std::deque<Stream *> starved_{};
+    bool flush_posted_ = false;
+    bool stopped_ = false;
+
+    char * buffer(unsigned short id) const{
+        return buffers_ + std::size_t(id) * buffer_size;
+    }
+    char * data(Chunk const & chunk) const{
+        return chunk.id == no_buffer ? chunk.copy.get() : buffer(chunk.id);
+    }
+    // back to the kernel, the tail is published at once
+    void give_back(unsigned short id){
+        auto & entry = buffer_ring_[buffer_tail_ & (num_of_buffers - 1)];
+        entry.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+        entry.len = buffer_size;
+        entry.bid = id;
+        ++buffer_tail_;
+        __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+        ++free_buffers_;
+    }
+    bool open(){
+        if(! ring_.open(num_of_entries, error_))
+            return false;
+        if(! buffer_ring_memory_.map((num_of_buffers * sizeof(io_uring_buf) + 4095) & ~std::size_t(4095)) || ! buffer_memory_.map(num_of_buffers * buffer_size)){
+            error_ = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        buffer_ring_ = static_cast<io_uring_buf *>(buffer_ring_memory_.data);
+        buffers_ = static_cast<char *>(buffer_memory_.data);
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(buffer_ring_);
+        reg.ring_entries = num_of_buffers;
+        reg.bgid = buffer_group;
+        if(ring_.register_resource(IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+            error_ = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        for(unsigned i = 0; i < num_of_buffers; ++i){
+            give_back(i);
+        }
+        event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(event_fd_ < 0 || ring_.register_resource(IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0){
+            error_ = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        event_.assign(event_fd_, error_);
+        return ! error_;
+    }
+    void wait(){
+        event_.async_read_some(boost::asio::null_buffers(), [this](boost::system::error_code const & ec, std::size_t){
+            if(ec || stopped_)
+                return;
+            std::uint64_t count;
+            while(::read(event_fd_, &count, sizeof(count)) < 0 && errno == EINTR){
+            }
+            ring_.reap([this](io_uring_cqe const & cqe){
+                complete(cqe);
+            });
+            rearm_starved();
+            ring_.submit();
+            wait();
+        });
+    }
+    // submissions made outside a completion go out once the current handler returns
+    void flush_later(){
+        if(flush_posted_)
+            return;
+        flush_posted_ = true;
+        io_.post([this](){
+            flush_posted_ = false;
+            ring_.submit();
+        });
+    }
+    static std::uint64_t user_data(Stream * stream, Operation op){
+        return reinterpret_cast<std::uint64_t>(stream) | op;
+    }
+    io_uring_sqe * sqe(){
+        auto sqe = ring_.get_sqe();
+        if(sqe)
+            flush_later();
+        return sqe;
+    }
+    bool may_receive(Stream const & stream) const{
+        return stream.chunks.size() < stream_buffers && (stream.chunks.empty() || ! MemoryBudget::instance().exceeded());
+    }
+    // the sockets stay O_NONBLOCK for asio, so a receive or a send may fail with -EAGAIN instead of
+    // waiting; it is then submitted again behind a poll for readiness, linked so it starts when
+    // the poll completes
+    bool poll_first(int fd, unsigned events){
+        auto s = sqe();
+        if(! s)
+            return false;
+        s->opcode = IORING_OP_POLL_ADD;
+        s->fd = fd;
+        s->poll32_events = events;
+        s->flags = IOSQE_IO_LINK;
+        s->user_data = op_cancel;
+        return true;
+    }
+    void receive(Stream & stream, bool poll = false){
+        if(poll && ! poll_first(stream.src, POLLIN)){
+            end(stream, boost::asio::error::no_buffer_space);
+            return;
+        }
+        auto s = sqe();
+        if(! s){
+            end(stream, boost::asio::error::no_buffer_space);
+            return;
+        }
+        s->opcode = IORING_OP_RECV;
+        s->fd = stream.src;
+        s->flags = IOSQE_BUFFER_SELECT;
+        s->buf_group = buffer_group;
+        s->ioprio = IORING_RECV_MULTISHOT;
+        s->user_data = user_data(&stream, op_recv);
+        stream.receiving = true;
+    }
+    // the multishot receive ends with -ECANCELED, the chunks already received are kept
+    void stop_receiving(Stream & stream){
+        if(! stream.receiving || stream.cancelling)
+            return;
+        auto s = sqe();
+        if(! s)
+            return;
+        s->opcode = IORING_OP_ASYNC_CANCEL;
+        s->addr = user_data(&stream, op_recv);
+        s->user_data = op_cancel;
+        stream.cancelling = true;
+    }
+    void send(Stream & stream, bool poll = false){
+        std::size_t n = 0;
+        for(auto const & chunk : stream.chunks){
+            if(n == max_gather)
+                break;
+            auto offset = n == 0 ? stream.sent : 0;
+            stream.iov[n].iov_base = data(chunk) + offset;
+            stream.iov[n].iov_len = chunk.size - offset;
+            ++n;
+        }
+        if(poll && ! poll_first(stream.dst, POLLOUT)){
+            end(stream, boost::asio::error::no_buffer_space);
+            return;
+        }
+        auto s = sqe();
+        if(! s){
+            end(stream, boost::asio::error::no_buffer_space);
+            return;
+        }
+        stream.message.msg_iov = stream.iov.data();
+        stream.message.msg_iovlen = n;
+        s->opcode = IORING_OP_SENDMSG;
+        s->fd = stream.dst;
+        s->addr = reinterpret_cast<std::uint64_t>(&stream.message);
+        s->len = 1;
+        s->msg_flags = MSG_NOSIGNAL;
+        s->user_data = user_data(&stream, op_send);
+        stream.sending = true;
+    }
+    void pop_front(Stream & stream){
+        if(stream.chunks.front().id != no_buffer)
+            give_back(stream.chunks.front().id);
+        stream.chunks.pop_front();
+        stream.sent = 0;
+        MemoryBudget::instance().charge(-static_cast<long long>(buffer_size));
+    }
+    // a direction waiting for its destination to drain must not hold ring buffers the others
+    // need, however long the peer takes: its chunks are copied out and the buffers given back.
+    // Not with a send in flight, which points into them
+    void spill(Stream & stream){
+        if(stream.sending)
+            return;
+        for(auto & chunk : stream.chunks){
+            if(chunk.id == no_buffer)
+                continue;
+            chunk.copy.reset(new char[chunk.size]);
+            std::memcpy(chunk.copy.get(), buffer(chunk.id), chunk.size);
+            give_back(chunk.id);
+            chunk.id = no_buffer;
+        }
+    }
+    // the handler runs once; the stream goes away when the kernel holds no request of it
+    void end(Stream & stream, boost::system::error_code const & ec){
+        if(stream.done)
+            return;
+        stream.done = true;
+        stop_receiving(stream);
+        auto handler = std::move(stream.handler);
+        stream.handler = Handler();
+        stream.observer = Observer();
+        io_.post([handler, ec](){
+            handler(ec, 0);
+        });
+    }
+    void release_if_idle(Stream & stream){
+        if(! stream.done || stream.receiving || stream.sending)
+            return;
+        while(! stream.chunks.empty()){
+            pop_front(stream);
+        }
+        starved_.erase(std::remove(starved_.begin(), starved_.end(), &stream), starved_.end());
+        streams_.erase(&stream);
+    }
+    // a direction ready to receive again queues behind the starved ones while the ring is short
+    void resume(Stream & stream){
+        if(! starved_.empty() && free_buffers_ < stream_buffers){
+            stream.starved = true;
+            starved_.push_back(&stream);
+            return;
+        }
+        receive(stream);
+    }
+    // as many of the oldest starved directions as the free buffers can serve
+    void rearm_starved(){
+        auto budget = free_buffers_;
+        while(! starved_.empty() && budget > 0){
+            auto & stream = *starved_.front();
+            starved_.pop_front();
+            stream.starved = false;
+            if(stream.done || stream.receiving || ! may_receive(stream))
+                continue;
+            receive(stream);
+            budget -= std::min(budget, stream_buffers - stream.chunks.size());
+        }
+    }
+    void complete(io_uring_cqe const & cqe){
+        auto op = cqe.user_data & 3;
+        if(op == op_cancel)
+            return;
+        auto & stream = *reinterpret_cast<Stream *>(cqe.user_data & ~std::uint64_t(3));
+        if(op == op_recv){
+            received(stream, cqe.res, cqe.flags);
+        }else{
+            sent(stream, cqe.res);
+        }
+        if(! stream.done && ! stream.receiving && ! stream.eof && ! stream.starved && may_receive(stream))
+            resume(stream);
+        release_if_idle(stream);
+    }
+    void received(Stream & stream, int res, unsigned flags){
+        if(! (flags & IORING_CQE_F_MORE)){
+            stream.receiving = false;
+            stream.cancelling = false;
+        }
+        if(flags & IORING_CQE_F_BUFFER){
+            auto id = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+            --free_buffers_;
+            if(res <= 0 || stream.done){
+                give_back(id);
+                return;
+            }
+            stream.chunks.emplace_back(id, static_cast<std::size_t>(res));
+            MemoryBudget::instance().charge(buffer_size);
+            Metrics::local().add_bytes(stream.direction, res);
+            if(stream.observer)
+                stream.observer(boost::asio::const_buffer(buffer(id), res));
+            if(! stream.sending)
+                send(stream);
+            if(! may_receive(stream))
+                stop_receiving(stream);
+            return;
+        }
+        if(stream.done || res == -ECANCELED)
+            return;
+        if(res == 0){
+            stream.eof = true;
+            if(! stream.sending && stream.chunks.empty())
+                end(stream, boost::asio::error::eof);
+        }else if(res == -EAGAIN){
+            receive(stream, true);
+        }else if(res == -ENOBUFS){
+            // every buffer is queued somewhere, start again when one comes back
+            stream.starved = true;
+            starved_.push_back(&stream);
+        }else if(res < 0){
+            end(stream, boost::system::error_code(-res, boost::system::system_category()));
+        }
+    }
+    void sent(Stream & stream, int res){
+        stream.sending = false;
+        if(stream.done)
+            return;
+        if(res == -EAGAIN){
+            spill(stream);
+            send(stream, true);
+            return;
+        }
+        if(res < 0){
+            end(stream, boost::system::error_code(-res, boost::system::system_category()));
+            return;
+        }
+        std::size_t n = res;
+        while(n > 0 && ! stream.chunks.empty()){
+            auto left = stream.chunks.front().size - stream.sent;
+            if(n < left){
+                stream.sent += n;
+                break;
+            }
+            n -= left;
+            pop_front(stream);
+        }
+        if(! stream.chunks.empty()){
+            send(stream);
+        }else if(stream.eof){
+            end(stream, boost::asio::error::eof);
+        }
+    }
+    void shutdown_service(){
+        stopped_ = true;
+        boost::system::error_code ec;
+        event_.close(ec);
+        // drops the handlers, and the pipes they keep alive
+        for(auto & stream : streams_){
+            stream.second->handler = Handler();
+            stream.second->observer = Observer();
+        }
+    }
+public:
+    explicit UringRelay(boost::asio::io_service & io)
+        : boost::asio::detail::service_base<UringRelay>(io), io_(io), event_(io){
+        if(open())
+            wait();
+    }
+    // false when the ring could not be set up on this io_service, error() tells why
+    bool available() const{
+        return ! error_ && event_fd_ >= 0;
+    }
+    boost::system::error_code const & error() const{
+        return error_;
+    }
+    // relays src to dst until eof or an error, then calls handler; the sockets stay open
+    // and owned by the caller, which must not use them in the meantime
+    void relay(int src, int dst, ThreadMetrics::Direction direction, Observer observer, Handler handler){
+        std::unique_ptr<Stream> stream(new Stream(src, dst, direction, std::move(observer), std::move(handler)));
+        auto & s = *stream;
+        streams_.emplace(&s, std::move(stream));
+        resume(s);
+        release_if_idle(s);
+    }
+    // whether this kernel has what the engine needs, checked once at startup; reason set when not
+    static bool supported(std::string & reason){
+        utsname name;
+        int major = 0, minor = 0;
+        if(::uname(&name) != 0 || std::sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6){
+            reason = "linux 6.0 or later is needed for multishot receive";
+            return false;
+        }
+        IoUring ring;
+        boost::system::error_code ec;
+        if(! ring.open(8, ec)){
+            reason = "io_uring_setup: " + ec.message();
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
+
+#endif